@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+# See LICENSE file for copyright and license details.
+#
+# Replays a corpus of typical terminal workloads through st-bench and reports
+# the throughput and peak memory use of each:
+#
+#     ./bench.py [-d dir] [-n MiB] [-r runs] [-s st-bench] [workload...]
+#
+# The corpus is generated into the directory (benchdata by default) the first
+# time it is needed and reused afterwards, so that runs of different builds
+# parse the same bytes. Each workload runs in its own st-bench process, which
+# makes the peak RSS that of the workload alone. The best of the runs is
+# reported.
+
+import argparse
+import base64
+import os
+import random
+import re
+import subprocess
+import sys
+
+COLS, ROWS = 120, 40
+
+ESC = '\x1b'
+CSI = ESC + '['
+
+WORDS = ('request', 'response', 'worker', 'session', 'cache', 'miss', 'hit',
+         'timeout', 'retry', 'connection', 'closed', 'opened', 'user',
+         'token', 'expired', 'queue', 'flush', 'commit', 'rollback', 'ok')
+LEVELS = ('DEBUG', 'INFO ', 'INFO ', 'INFO ', 'WARN ', 'ERROR')
+
+
+def words(rnd, n):
+    return ' '.join(rnd.choice(WORDS) for _ in range(n))
+
+
+def gen_log(rnd):
+    """A `cat` of an application log: plain ASCII lines."""
+    t = 0
+    while True:
+        t += rnd.randrange(1000)
+        yield ('2024-05-%02d %02d:%02d:%02d.%03d %s [worker-%d] %s '
+               'id=%08x took=%dms\n'
+               % (1 + t // 86400000 % 28, t // 3600000 % 24,
+                  t // 60000 % 60, t // 1000 % 60, t % 1000,
+                  rnd.choice(LEVELS), rnd.randrange(32),
+                  words(rnd, rnd.randrange(3, 12)), rnd.getrandbits(32),
+                  rnd.randrange(5000)))
+
+
+def gen_sgr(rnd):
+    """Dense truecolor output, as from syntax highlighters and lolcat."""
+    while True:
+        line = []
+        for _ in range(rnd.randrange(4, 16)):
+            line.append('%s38;2;%d;%d;%dm' % ((CSI,) + tuple(
+                rnd.randrange(256) for _ in range(3))))
+            if rnd.random() < 0.3:
+                line.append('%s48;2;%d;%d;%dm' % ((CSI,) + tuple(
+                    rnd.randrange(256) for _ in range(3))))
+            if rnd.random() < 0.2:
+                line.append(CSI + rnd.choice(('1', '3', '4', '7')) + 'm')
+            line.append(rnd.choice(WORDS) + ' ')
+        line.append(CSI + 'm\n')
+        yield ''.join(line)
+
+
+# Ranges of wide characters: CJK ideographs, hiragana, katakana, Hangul
+# syllables and emoji.
+WIDE = ((0x4E00, 0x9FFF), (0x3041, 0x3096), (0x30A1, 0x30FA),
+        (0xAC00, 0xD7A3), (0x1F300, 0x1F64F))
+
+
+def gen_cjk(rnd):
+    """Wide glyphs: CJK text with some emoji, wrapping at the margin."""
+    while True:
+        line = []
+        width = 0
+        while width < COLS * 3:
+            lo, hi = WIDE[min(rnd.randrange(12), len(WIDE) - 1)]
+            line.append(chr(rnd.randint(lo, hi)))
+            width += 2
+            if rnd.random() < 0.1:
+                line.append(' ')
+                width += 1
+        line.append('\n')
+        yield ''.join(line)
+
+
+def gen_scroll(rnd):
+    """Scroll region churn, as from pagers, tmux panes and IRC clients."""
+    while True:
+        top = rnd.randrange(1, ROWS // 2)
+        bot = rnd.randrange(top + 2, ROWS + 1)
+        out = ['%s%d;%dr' % (CSI, top, bot),
+               '%s%d;1H' % (CSI, bot)]
+        for _ in range(rnd.randrange(10, 60)):
+            r = rnd.random()
+            if r < 0.7:
+                out.append('\n' + words(rnd, rnd.randrange(2, 14)))
+            elif r < 0.8:
+                out.append('%s%dH%sM' % (CSI, top, ESC))
+            elif r < 0.9:
+                out.append('%s%d;1H%s%dL' % (CSI, rnd.randint(top, bot),
+                                             CSI, rnd.randrange(1, 4)))
+            else:
+                out.append('%s%d;1H%s%dM' % (CSI, rnd.randint(top, bot),
+                                             CSI, rnd.randrange(1, 4)))
+        out.append(CSI + 'r')
+        yield ''.join(out)
+
+
+def gen_redraw(rnd):
+    """Full-screen applications: vim and htop style repaints."""
+    n = 0
+    while True:
+        n += 1
+        out = [CSI + '?25l']
+        if n % 10 == 0:
+            out.append(CSI + 'H' + CSI + '2J')
+        if n % 2:
+            # an editor: line numbers, highlighted code and a status line
+            for y in range(1, ROWS):
+                out.append('%s%d;1H%s38;5;130m%4d %s' % (
+                    CSI, y, CSI, n + y, CSI + 'm'))
+                for _ in range(rnd.randrange(0, 10)):
+                    out.append('%s38;5;%dm%s ' % (CSI, rnd.randrange(256),
+                                                  rnd.choice(WORDS)))
+                out.append(CSI + 'm' + CSI + 'K')
+            out.append('%s%d;1H%s7m "st.c" %dL --%d%%-- %s%s27m' % (
+                CSI, ROWS, CSI, n, n % 100, ' ' * (COLS - 40), CSI))
+            out.append('%s%d;%dH' % (CSI, rnd.randrange(1, ROWS),
+                                     rnd.randrange(1, COLS)))
+        else:
+            # a process monitor: meters and a table of processes
+            for y in range(1, 5):
+                used = rnd.randrange(COLS - 20)
+                out.append('%s%d;3H%s1m%d%s[%s32m%s%s31m%s%s%s]' % (
+                    CSI, y, CSI, y, CSI + 'm', CSI, '|' * (used // 2),
+                    CSI, '|' * (used - used // 2), ' ' * (COLS - 20 - used),
+                    CSI + 'm'))
+            out.append('%s6;1H%s30;42m  PID USER  CPU%% MEM%% COMMAND%s%s' % (
+                CSI, CSI, CSI + 'K', CSI + 'm'))
+            for y in range(7, ROWS):
+                out.append('%s%d;1H%5d %s36m%-5s%s %4.1f %4.1f %s%s' % (
+                    CSI, y, rnd.randrange(1, 99999), CSI,
+                    rnd.choice(('root', 'me', 'www')), CSI + 'm',
+                    rnd.random() * 100, rnd.random() * 10,
+                    words(rnd, rnd.randrange(1, 4)), CSI + 'K'))
+        out.append(CSI + '?25h')
+        yield ''.join(out)
+
+
+def gen_osc52(rnd):
+    """Long OSC 52 selections, as copied by editors over ssh."""
+    while True:
+        data = words(rnd, rnd.randrange(1000, 100000)).encode()
+        yield '%s]52;c;%s\a%s\n' % (ESC, base64.b64encode(data).decode(),
+                                     words(rnd, 8))
+
+
+WORKLOADS = {
+    'log': gen_log,
+    'sgr': gen_sgr,
+    'cjk': gen_cjk,
+    'scroll': gen_scroll,
+    'redraw': gen_redraw,
+    'osc52': gen_osc52,
+}
+
+
+def generate(name, path, size):
+    rnd = random.Random(name)
+    written = 0
+    with open(path, 'wb') as f:
+        for chunk in WORKLOADS[name](rnd):
+            data = chunk.encode()
+            f.write(data)
+            written += len(data)
+            if written >= size:
+                break
+
+
+RESULT = re.compile(r': (\d+) bytes in ([\d.]+) s, ([\d.]+) MB/s, (\d+) '
+                    r'runes/s, (\d+) sequences/s, peak RSS (\d+) KiB$')
+
+
+def run(stbench, path, runs):
+    """Returns MB/s, runes/s and sequences/s of the fastest run, and the
+    largest peak RSS."""
+    results = []
+    for _ in range(runs):
+        out = subprocess.run([stbench, '-g', '%dx%d' % (COLS, ROWS), path],
+                             check=True, stdout=subprocess.PIPE,
+                             universal_newlines=True).stdout
+        m = RESULT.search(out.strip())
+        if not m:
+            sys.exit('unexpected output from %s: %s' % (stbench, out))
+        results.append((float(m.group(3)), int(m.group(4)),
+                        int(m.group(5)), int(m.group(6))))
+    return max(results)[:3] + (max(r[3] for r in results),)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Replay a terminal workload corpus through st-bench.')
+    parser.add_argument('-d', default='benchdata', metavar='dir',
+                        help='corpus directory (default: %(default)s)')
+    parser.add_argument('-n', type=int, default=16, metavar='MiB',
+                        help='size of generated workloads (default: '
+                        '%(default)s)')
+    parser.add_argument('-r', type=int, default=3, metavar='runs',
+                        help='runs per workload (default: %(default)s)')
+    parser.add_argument('-s', default='./st-bench', metavar='st-bench',
+                        help='benchmark binary (default: %(default)s)')
+    parser.add_argument('workloads', nargs='*', metavar='workload',
+                        help='any of %s (default: all)'
+                        % ', '.join(WORKLOADS))
+    args = parser.parse_args()
+
+    for name in args.workloads:
+        if name not in WORKLOADS:
+            parser.error('unknown workload: %s' % name)
+    os.makedirs(args.d, exist_ok=True)
+
+    print('%-8s %10s %12s %12s %12s' % ('workload', 'MB/s', 'runes/s',
+                                        'seqs/s', 'peak RSS KiB'))
+    for name in args.workloads or WORKLOADS:
+        path = os.path.join(args.d, name)
+        if not os.path.exists(path):
+            generate(name, path, args.n << 20)
+        mbs, runes, seqs, rss = run(args.s, path, args.r)
+        print('%-8s %10.1f %12d %12d %12d' % (name, mbs, runes, seqs, rss))
+
+
+if __name__ == '__main__':
+    main()
@@ -18,13 +18,20 @@ static const int borderpx = 2;
  * 5: value of shell in config.h
  */
 static const char shell[] = "/bin/sh";
-static const char *utmp = NULL;
+static const char *const utmp = NULL;
 static const char stty_args[] = "stty raw pass8 nl -echo -iexten -cstopb 38400";
 
 /* The command executed for entering Unicode code points. */
 static const char iso14755_cmd[] =
     "dmenu -p 'Unicode code point in hexadecimal:' < /dev/null";
 
+/*
+ * Width in cells of the characters whose East Asian width is ambiguous, like
+ * Greek and Cyrillic letters or box drawing characters: 1 or 2. CJK fonts
+ * usually draw them wide.
+ */
+static const int ambiguouswidth = 1;
+
 /* Form of C1 controls accepted in UTF-8 mode. */
 static enum c1utf8_form c1utf8_as = 0;
 
@@ -53,10 +60,38 @@ static const unsigned int tripleclicktimeout = 600;
 /* alt screens */
 static const int allowaltscreen = 1;
 
+/*
+ * scrollback: the last histsize lines of history are kept as they were on
+ * the screen, up to histmax older ones compressed. Once these take histmem
+ * bytes, the oldest go to an unlinked file in $TMPDIR (or /tmp), or are
+ * dropped if histspill is 0. See kscrollup().
+ */
+static const unsigned int histsize = 2000;
+static const unsigned int histmax = 1000000;
+static const size_t histmem = 16 << 20;
+static const int histspill = 1;
+
 /* frames per second st should at maximum draw to the screen */
 static const unsigned int xfps = 120;
 static const unsigned int actionfps = 30;
 
+/*
+ * longest time (in milliseconds) st waits for an application to end a
+ * synchronized update (mode 2026) before drawing anyway
+ */
+static const unsigned int synctimeout = 200;
+
+/*
+ * tty reads: the read buffer starts at ttybufmin bytes and doubles up to
+ * ttybufmax while the output keeps filling it. On each wakeup st reads until
+ * the tty is empty, or until it has read ttydrainbytes bytes or spent
+ * ttydraintimeout milliseconds, and then goes back to drawing.
+ */
+static const size_t ttybufmin = 64 * 1024;
+static const size_t ttybufmax = 1024 * 1024;
+static const size_t ttydrainbytes = 4 * 1024 * 1024;
+static const unsigned int ttydraintimeout = 1000 / 120;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -169,6 +204,9 @@ static const unsigned int defaultattr = 7;
  */
 static const char defaultosc52[] = "c";
 
+// Largest selection, in bytes after decoding, that OSC 52 may set.
+static const size_t osc52max = 8 * 1024 * 1024;
+
 /*
  * Internal mouse shortcuts.
  * Beware that overloading Button1 will disable the selection.
@@ -201,6 +239,8 @@ static const Shortcut shortcuts[] = {
     { ControlShiftMask,         XK_L,           iso14755,        0 },
     { ControlShiftMask,         XK_V,           clippaste,       0 },
     { ControlMod1ShiftMask,     XK_V,           selpaste,        0 },
+    { ShiftMask,                XK_Page_Up,     kscrollup,      -1 },
+    { ShiftMask,                XK_Page_Down,   kscrolldown,    -1 },
 };
 // clang-format on
 
@@ -31,7 +31,7 @@ CXXFLAGS += -std=c++11
 LDFLAGS += -L/usr/lib -L${X11LIB} \
        $(shell pkg-config --libs-only-L fontconfig)  \
        $(shell pkg-config --libs-only-L freetype2)
-LDLIBS += -lc -lm ${OSDEP_LIBS} -lX11 -lutil -lXft \
+LDLIBS += -lc -lm ${OSDEP_LIBS} -lpthread -lX11 -lutil -lXft \
        $(shell pkg-config --libs-only-l fontconfig)  \
        $(shell pkg-config --libs-only-l freetype2)
 
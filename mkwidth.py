@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# See LICENSE file for copyright and license details.
+#
+# Generates width.h, the table behind runewidth() in st.c:
+#
+#     ./mkwidth.py [UCD directory] > width.h
+#
+# The directory must hold UnicodeData.txt and EastAsianWidth.txt from
+# https://www.unicode.org/Public/UCD/latest/ucd/. Without it, the Unicode
+# database of the Python interpreter is used instead.
+
+import sys
+
+BLOCK = 128  # code points per second-level block
+MAXRUNE = 0x10FFFF
+
+# Width classes, see runewidth() in st.c.
+ZERO, ONE, TWO, AMBIGUOUS, NONPRINT = range(5)
+
+# Format characters that are visible: the soft hyphen and the
+# Prepended_Concatenation_Mark characters.
+VISIBLE_FORMAT = {0x00AD, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605,
+                  0x06DD, 0x070F, 0x0890, 0x0891, 0x08E2, 0x110BD, 0x110CD}
+
+# Blocks whose unassigned code points have a wide default width.
+WIDE_DEFAULT = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+
+def parse_ranges(path):
+    """Yields (first, last, fields) for each line of a UCD file."""
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = [x.strip() for x in line.split(';')]
+            first, _, last = fields[0].partition('..')
+            yield int(first, 16), int(last or first, 16), fields[1:]
+
+
+def load_ucd(path):
+    category = ['Cn'] * (MAXRUNE + 1)
+    eaw = ['N'] * (MAXRUNE + 1)
+    start = None
+    for cp, _, fields in parse_ranges(path + '/UnicodeData.txt'):
+        # big ranges are given as a <..., First> and <..., Last> pair
+        if fields[0].endswith(', First>'):
+            start = cp
+            continue
+        for u in range(cp if start is None else start, cp + 1):
+            category[u] = fields[1]
+        start = None
+    for first, last, fields in parse_ranges(path + '/EastAsianWidth.txt'):
+        for u in range(first, last + 1):
+            eaw[u] = fields[0]
+    # the first line names the file, e.g. "# EastAsianWidth-15.1.0.txt"
+    with open(path + '/EastAsianWidth.txt', encoding='utf-8') as f:
+        version = f.readline().strip('# \n')
+    return category.__getitem__, eaw.__getitem__, version
+
+
+def load_python():
+    import unicodedata
+    return (lambda u: unicodedata.category(chr(u)),
+            lambda u: unicodedata.east_asian_width(chr(u)),
+            'Unicode %s' % unicodedata.unidata_version)
+
+
+def classify(u, category, eaw):
+    cat = category(u)
+    if cat in ('Cc', 'Cs'):
+        return NONPRINT
+    if cat == 'Cn':
+        # noncharacters
+        if 0xFDD0 <= u <= 0xFDEF or (u & 0xFFFE) == 0xFFFE:
+            return NONPRINT
+        if any(a <= u <= b for a, b in WIDE_DEFAULT):
+            return TWO
+        return ONE
+    if cat in ('Mn', 'Me') or (cat == 'Cf' and u not in VISIBLE_FORMAT):
+        return ZERO
+    # Hangul medial vowels and final consonants join the previous jamo.
+    if 0x1160 <= u <= 0x11FF or 0xD7B0 <= u <= 0xD7FF:
+        return ZERO
+    width = eaw(u)
+    if width in ('W', 'F'):
+        return TWO
+    if width == 'A':
+        return AMBIGUOUS
+    return ONE
+
+
+def main():
+    if len(sys.argv) > 1:
+        category, eaw, version = load_ucd(sys.argv[1])
+    else:
+        category, eaw, version = load_python()
+
+    blocks, index = [], []
+    ids = {}
+    for base in range(0, MAXRUNE + 1, BLOCK):
+        block = tuple(classify(u, category, eaw)
+                      for u in range(base, base + BLOCK))
+        if block not in ids:
+            ids[block] = len(blocks)
+            blocks.append(block)
+        index.append(ids[block])
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('/* Generated by mkwidth.py from %s. Do not edit. */\n\n'
+              % version)
+    out.write('#define WIDTH_BLOCK %d\n' % BLOCK)
+    out.write('#define WIDTH_AMBIGUOUS %d\n' % AMBIGUOUS)
+    out.write('#define WIDTH_NONPRINT %d\n\n' % NONPRINT)
+
+    out.write('/* Block of each run of WIDTH_BLOCK code points. */\n')
+    out.write('static const unsigned char widthindex[%d] = {\n'
+              % len(index))
+    for i in range(0, len(index), 16):
+        out.write('\t' + ', '.join('%d' % x for x in index[i:i + 16])
+                  + ',\n')
+    out.write('};\n\n')
+
+    out.write('/* Width class of each code point in a block. */\n')
+    out.write('static const unsigned char widthblocks[%d][WIDTH_BLOCK] = {\n'
+              % len(blocks))
+    for block in blocks:
+        out.write('\t{\n')
+        for i in range(0, BLOCK, 32):
+            out.write('\t\t' + ','.join('%d' % x for x in block[i:i + 32])
+                      + ',\n')
+        out.write('\t},\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
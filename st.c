@@ -17,14 +17,18 @@
 #include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -57,20 +61,34 @@
 #define UNUSED
 #endif
 
+// UTF-8 and base64 decoding pick between SSE2, SSSE3 and AVX2 at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define Glyph Glyph_
 #define Font Font_
 
+#ifndef HEADLESS
 // See the XEmbed Protocol Specification
 // <https://standards.freedesktop.org/xembed-spec/xembed-spec-latest.html> for
 // more info.
 #define XEMBED_FOCUS_IN 4
 #define XEMBED_FOCUS_OUT 5
+#endif
 
 // Arbitrary sizes.
 #define ESC_BUF_SIZ 65536
-#define ESC_ARG_SIZ 16
+#define ESC_ARG_SIZ 256
+#define ESC_ARG_MAX 65535
 #define STR_BUF_SIZ ESC_BUF_SIZ
-#define STR_ARG_SIZ ESC_ARG_SIZ
+#define STR_ARG_SIZ 16
+#define PRINT_BUF_SIZ 65536
+#define HIST_BLOCK_SIZ 65536
+#define HIST_CACHE 64
+#define HIST_BATCH 256
+#define PARSE_OTHER 0xA0
 #define XK_ANY_MOD UINT_MAX
 #define XK_SWITCH_MOD (1 << 13)
 
@@ -86,8 +104,12 @@
 #define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u) (utf8strchr(worddelimiters, u) != NULL)
 #define LIMIT(x, a, b) (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b) \
-	((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
+#ifndef HEADLESS
+#define ATTRCMP(a, b) ((a).attr != (b).attr)
+#endif
+#define ATTREQ(a, b) \
+	((a).mode == (b).mode && (a).fg == (b).fg && (a).bg == (b).bg)
+#define ATTRMODE(g) (term.attrs[(g).attr].mode)
 #define IS_SET(flag) ((term.mode & (flag)) != 0)
 #define TIMEDIFF(t1, t2)                      \
 	(((t1).tv_sec - (t2).tv_sec) * 1000 + \
@@ -95,10 +117,12 @@
 #define MODBIT(x, set, bit) ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
 
 #define TRUECOLOR(r, g, b) (1 << 24 | (r) << 16 | (g) << 8 | (b))
+#ifndef HEADLESS
 #define IS_TRUECOL(x) (1 << 24 & (x))
 #define TRUERED(x) (((x)&0xFF0000) >> 8)
 #define TRUEGREEN(x) (((x)&0xFF00))
 #define TRUEBLUE(x) (((x)&0xFF) << 8)
+#endif
 #define XA_CLIPBOARD XInternAtom(xw.dpy, "CLIPBOARD", 0)
 
 // Form of C1 controls accepted in UTF-8 mode.
@@ -123,6 +147,11 @@ enum glyph_attribute {
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
+// Attributes with a fixed index in term.attrs, see tattrinit()
+enum attr_id {
+	ATTRID_BLANK,  // no flags and the default colors
+};
+
 enum cursor_movement {
 	CURSOR_SAVE,  // Save the current cursor.
 	CURSOR_LOAD   // Restore the cursor.
@@ -160,6 +189,7 @@ enum term_mode {
 	MODE_ENABLE_COLUMN_CHANGE = 1 << 22,
 	MODE_CLEAR_ON_DECCOLM = 1 << 23,
 	MODE_WRITABLE_STATUS_LINE = 1 << 24,
+	MODE_SYNC = 1 << 25,
 	MODE_MOUSE =
 	    MODE_MOUSEBTN | MODE_MOUSEMOTION | MODE_MOUSEX10 | MODE_MOUSEMANY,
 };
@@ -172,15 +202,34 @@ enum charset {
 	           // alternate character set.
 };
 
-enum escape_state {
-	ESC_START = 1,
-	ESC_CSI = 2,
-	ESC_STR = 4,  // OSC, PM, APC
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END = 16,  // a final string was encountered
-	ESC_TEST = 32,     // Enter in test mode
-	ESC_UTF8 = 64,
-	ESC_DCS = 128,
+// Parser states, after the DEC VT500 state diagram.
+enum parse_state {
+	PS_GROUND,
+	PS_ESCAPE,
+	PS_ESCAPE_INTERMEDIATE,
+	PS_CSI_ENTRY,
+	PS_CSI_PARAM,
+	PS_CSI_INTERMEDIATE,
+	PS_CSI_IGNORE,
+	PS_STRING,    // OSC, DCS, SOS, PM, APC
+	PS_NUM,       // number of states
+	PS_ANYWHERE,  // in parser rules, every state
+	PS_STAY,      // in transitions, keep the current state
+};
+
+// What the parser does with a character on a transition.
+enum parse_action {
+	PA_NONE,          // ignore the character
+	PA_PRINT,         // display the character
+	PA_EXECUTE,       // perform a C0 or C1 control function
+	PA_CLEAR,         // forget the current sequence
+	PA_COLLECT,       // store a private marker or an intermediate
+	PA_PARAM,         // add a digit or a separator to the parameters
+	PA_ESC_DISPATCH,  // perform an escape sequence
+	PA_CSI_DISPATCH,  // perform a control sequence
+	PA_STR_START,     // start a control string
+	PA_STR_PUT,       // add the character to the control string
+	PA_STR_DISPATCH,  // perform the control string
 };
 
 enum window_state {
@@ -216,62 +265,203 @@ static const size_t max_utf8_bytes = 4;
 typedef XftDraw *Draw;
 typedef XftColor Color;
 
+// Attributes of glyphs, interned in term.attrs, see tattrid()
 typedef struct {
-	Rune u;       // character code
 	ushort mode;  // attribute flags
 	uint32_t fg;  // foreground
 	uint32_t bg;  // background
+} Attr;
+
+typedef struct {
+	Rune u;         // character code
+	uint32_t attr;  // index of the attributes in term.attrs
 } Glyph;
 
 typedef Glyph *Line;
 
 typedef struct {
-	Glyph attr;  // current char attributes
+	Attr attr;  // current char attributes
 	int x;
 	int y;
 	char state;
 } TCursor;
 
+// A parser rule sets the transition of a state on a range of characters.
+// Every character from PARSE_OTHER on is treated like PARSE_OTHER.
+typedef struct {
+	uchar state;  // state the rule applies to, or PS_ANYWHERE
+	uchar first;  // first character of the range
+	uchar last;   // last character of the range
+	uchar action;
+	uchar next;  // next state, or PS_STAY
+} ParseRule;
+
+typedef struct {
+	uchar action;
+	uchar state;
+} Transition;
+
 // CSI Escape sequence structs
-// ESC '[' [[ [<interm>] <arg> [;]] <mode> [<mode>]]
+// ESC '[' [<priv>] [<arg> [;|:]] [<interm>] <final>
+// ESC [<interm>] <final> uses interm too.
+// Arguments after a ':' are sub-parameters of the one before, as in 38:2::r:g:b.
+// Only the arguments up to narg are valid, except that the first two are zero
+// when they weren't given.
 typedef struct {
-	char buf[ESC_BUF_SIZ];  // raw string
-	size_t len;             // raw string length
-	char interm;
+	char priv;   // private marker
+	int interm;  // intermediate, -1 if there are several
+	char final;
 	int arg[ESC_ARG_SIZ];
-	int narg;  // nb of args
-	char mode[2];
+	char sub[ESC_ARG_SIZ];  // whether arg[i] is a sub-parameter
+	int narg;               // nb of args
+	int nsub;               // nb of sub-parameters
 } CSIEscape;
 
+// Handler of the control sequences with the given private marker,
+// intermediate and final character. Returns nonzero if the parameters aren't
+// supported.
+typedef struct {
+	char priv;
+	char interm;
+	char final;
+	int (*func)(void);
+	char subparams;  // whether func takes sub-parameters
+} CSIHandler;
+
 // STR Escape sequence structs
 // ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\'
+// Strings that don't fit in buf are streamed to their command as they arrive,
+// see strflush().
 typedef struct {
 	char type;              // ESC type ...
 	char buf[STR_BUF_SIZ];  // raw string
 	int len;                // raw string length
 	char *args[STR_ARG_SIZ];
-	int narg;  // nb of args
+	int narg;    // nb of args
+	int hdrlen;  // length of the unstreamed head of a streamed string
+	char *data;  // decoded data
+	size_t datalen, datasize;
+	int padded;  // whether the base64 padding was seen
+	int err;     // whether the data is invalid
 } STREscape;
 
+// Columns of a line changed since a generation, see tpublish()
+typedef struct {
+	ulong gen;   // generation the change applies to
+	int x0, x1;  // first column changed, and last plus one
+} Damage;
+
 // Internal representation of the screen
 typedef struct {
 	ushort row;                 // nb row
 	ushort col;                 // nb col
-	Line *line;                 // screen
+	Line *line;                 // screen, in the ring or alt
 	Line *alt;                  // alternate screen
+	Line *ring;                 // main screen and history, see tsyncring()
+	int ringsize;               // lines in the ring
+	Glyph *arena;               // lines of ring and alt, see tresize()
+	int stride;                 // glyphs a line of arena has room for
+	int rowcap;                 // rows the arena has room for
+	ushort *linemode;           // modes of glyphs in rows of arena, or more
+	int start;                  // ring index of the top screen line
+	int histn;                  // lines of history above the screen
+	int scroll;                 // lines the view is scrolled back
 	int *dirty;                 // dirtyness of lines
-	XftGlyphFontSpec *specbuf;  // font spec buffer used for rendering
+	Damage *damage;             // columns of them changed, see tdamage()
+	ulong *gen;                 // generation of lines, see tpublish()
 	TCursor c;                  // cursor
+	TCursor saved[2];           // cursors saved by tcursor(), by screen
 	int top;                    // top    scroll limit
 	int bot;                    // bottom scroll limit
 	int mode;                   // terminal mode flags
-	int esc;                    // escape state flags
+	int esc;                    // escape sequence parser state
 	enum charset trantbl[4];    // charset table translation
 	int charset;                // current charset
 	int icharset;               // selected charset for sequence
 	int *tabs;
+	struct timespec syncstart;  // start of the synchronized update
+	Attr *attrs;                // attributes of glyphs, see tattrid()
+	uint32_t *attrhash;         // 1 + index of attrs, by hash, or 0
+	uint32_t nattr, attrsize;   // attrs used, and room for them
+	uint32_t attrmax;           // nattr that makes tattrgc() run
+	uint32_t attrmemo[4];       // the last attributes looked up
+	ulong attrgen;              // count of renumberings of attrs
 } Term;
 
+// New lines of the ring being rewrapped, see treflow()
+typedef struct {
+	Line *ring;        // the lines, by number modulo ringsize
+	int ringsize;
+	int col;           // width of the lines
+	int h, n;          // number of the oldest line kept, and of the next
+	Glyph *arena;      // arena of the lines
+	int stride;
+	int *pool, npool;  // free rows of arena, the lowest last
+} Reflow;
+
+// Point moved by treflow() along with the glyph it is on
+typedef struct {
+	int *x, *y;  // the point, in lines of the screen
+	int off;     // glyphs before it in its logical line, or -1
+	int moved;   // whether *y is the number of a new line yet
+} Mark;
+
+// Text serialized from the screen, see tserialize()
+typedef struct {
+	char *buf;
+	size_t len, size;
+} Sink;
+
+// Compressed lines of history, see hpush()
+typedef struct {
+	Sink data;       // the lines, freed but for len once spilled
+	off_t off;       // offset of the lines in the spill file
+	uint32_t *offs;  // offset of each line in the lines
+	int n;           // nb lines
+	ulong first;     // number of the first line
+} HistBlock;
+
+// History older than the ring, oldest block first
+typedef struct {
+	HistBlock *blk;
+	int nblk, blksize;
+	int nspilled;               // blocks in the spill file, the oldest
+	int n;                      // lines in all blocks
+	ulong first;                // number of the oldest line
+	size_t mem;                 // bytes of the blocks in memory
+	int fd;                     // spill file, or -1
+	int nospill;                // whether the spill file failed
+	off_t flen, fdead;          // bytes in it, and of dropped blocks
+	const uchar *map;           // the spill file, mapped up to maplen
+	size_t maplen;
+	Line cache[HIST_CACHE];     // lines decompressed by tline()
+	ulong cachekey[HIST_CACHE]; // 1 + number of each line, or 0
+	int cachecol;               // width of the lines in the cache
+} History;
+
+// Copy of the screen made by the tty thread for the drawing thread
+typedef struct {
+	int row, col;
+	Line *line;   // lines, with FRAME_REVERSE on the selection
+	Glyph *buf;   // glyphs of the lines
+	ulong *gen;   // generation of lines, as in term.gen
+	Damage *damage;  // what changed in them, as in term.damage
+	Attr *attrs;  // copy of term.attrs for the glyphs
+	uint32_t nattr, attrsize;
+	ulong attrgen;  // term.attrgen of attrs
+	TCursor c;    // cursor
+	int cursor;   // cursor style
+	int cursel;   // whether the cursor is in the selection
+	int mode;     // terminal mode flags
+	int blink;    // whether a glyph blinks
+} Frame;
+
+// A glyph the way it looks in the window, see xlook()
+typedef struct {
+	Rune u;
+	Attr a;
+} Look;
+
 // Purely graphic info
 typedef struct {
 	Display *dpy;
@@ -356,10 +546,15 @@ static void iso14755(int /*unused*/);
 static void toggleprinter(int /*unused*/);
 static void sendbreak(int /*unused*/);
 static void reset(int /*unused*/);
+static void kscrollup(int /*n*/);
+static void kscrolldown(int /*n*/);
 
 // Config.h for applying patches and the configuration.
 #include "config.h"
 
+// Character widths, generated by mkwidth.py.
+#include "width.h"
+
 // Font structure
 typedef struct {
 	int height;
@@ -383,31 +578,81 @@ typedef struct {
 } DC;
 
 NORETURN static void die(const char * /*errstr*/, ...);
-static void draw(void);
 static void redraw(void);
+#ifndef HEADLESS
+static void draw(void);
 static void drawregion(int /*x1*/, int /*y1*/, int /*x2*/, int /*y2*/);
+static int tpublish(void);
+static void *ttythread(void * /*unused*/);
 static void execsh(void);
 static void stty(void);
 static void sigchld_handler(UNUSED int /*unused*/);
 static void sigsegv_handler(UNUSED int /*sig*/);
 static int run(void);
+#endif
 
 static void chardump(char c);
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
 static void csireset(void);
-static int eschandle(uchar /*ascii*/);
+static int csicbt(void);
+static int csicha(void);
+static int csicht(void);
+static int csicnl(void);
+static int csicpl(void);
+static int csicub(void);
+static int csicud(void);
+static int csicuf(void);
+static int csicup(void);
+static int csicuu(void);
+static int csida(void);
+static int csida2(void);
+static int csidch(void);
+static int csidecrc(void);
+static int csidecrqm(void);
+static int csidecsc(void);
+static int csidecscpp(void);
+static int csidecscusr(void);
+static int csidecssdt(void);
+static int csidecstbm(void);
+static int csidl(void);
+static int csidsr(void);
+static int csiech(void);
+static int csied(void);
+static int csiel(void);
+static int csiignore(void);
+static int csiich(void);
+static int csiil(void);
+static int csimc(void);
+static int csirm(void);
+static int csisd(void);
+static int csisgr(void);
+static int csism(void);
+static int csisu(void);
+static int csitbc(void);
+static int csivpa(void);
+static void eschandle(uchar /*ascii*/);
+static void parserinit(void);
+static int strdecode64(const char * /*s*/, size_t /*len*/);
 static void strdump(void);
+static int strflush(void);
 static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
 
+#ifndef HEADLESS
+static int tattrline(int /*y*/, int /*attr*/);
 static int tattrset(int /*attr*/);
+static void tsetdirtattr(int /*attr*/);
+#endif
 static void tprinter(const char * /*s*/, size_t /*len*/);
+static void tprinterflush(void);
 static void tdumpsel(void);
-static void tdumpline(int /*n*/);
+static void tdumplines(int /*y1*/, int /*y2*/);
 static void tdump(void);
+static int tserialize(Sink * /*sk*/, int /*y*/, int /*x1*/, int /*x2*/);
+static char *sinkreserve(Sink * /*sk*/, size_t /*n*/);
+static void sinkwrite(Sink * /*sk*/, const char * /*s*/, size_t /*n*/);
 static void tclearregion(int /*x1*/, int /*y1*/, int /*x2*/, int /*y2*/);
 static void tcursor(enum cursor_movement /*mode*/);
 static void tdeletechar(int /*n*/);
@@ -420,52 +665,92 @@ static void tmoveato(int /*x*/, int /*y*/);
 static void tnew(int /*col*/, int /*row*/);
 static void tnewline(int /*first_col*/);
 static void tputtab(int /*n*/);
-static void tputc(Rune /*u*/);
+static void tputcparse(Rune /*u*/);
+static void tputcprint(Rune /*u*/);
+static size_t twrite(const char * /*s*/, size_t /*len*/);
+static void tparseraction(int /*action*/, Rune /*u*/);
+static inline void tputglyphmode(Rune /*u*/, int /*utf8*/, int /*wrap*/,
+                                 int /*insert*/);
+static void tputglyphplain(Rune /*u*/);
+static void tputglyphany(Rune /*u*/);
+static void tspecialize(void);
+static size_t tencode(Rune /*u*/, char * /*c*/);
+static size_t tputascii(const Rune * /*u*/, size_t /*len*/);
 static void treset(void);
 static void tresize(int /*col*/, int /*row*/);
-static void tscrollup(int /*orig*/, int /*n*/);
+static Line tkeepline(Line /*l*/, Glyph * /*arena*/, int /*stride*/,
+                      uchar * /*used*/, int * /*next*/, int /*len*/);
+static int treflow(Reflow * /*rf*/, int /*row*/);
+static Line treflowrow(Reflow * /*rf*/, Line /*l*/);
+static void tsetwrap(Line /*l*/, int /*col*/);
+static void tscrollup(int /*orig*/, int /*n*/, int /*copyhist*/);
+static void thistpush(int /*n*/);
+static void thistclear(void);
+static void thistcompress(int /*n*/);
+static void thistidle(void);
 static void tscrolldown(int /*orig*/, int /*n*/);
-static void tsetattr(int * /*attr*/, int /*l*/);
-static void tsetchar(Rune /*u*/, const Glyph * /*attr*/, int /*x*/, int /*y*/);
+static void tsetattr(const int * /*attr*/, const char * /*sub*/, int /*l*/);
+static void tsetchar(Rune /*u*/, const Attr * /*attr*/, int /*x*/, int /*y*/);
+static void tattrinit(void);
+static inline uint32_t tattrid(const Attr * /*a*/);
+static uint32_t tattrintern(const Attr * /*a*/);
+static inline uint32_t tattrmod(uint32_t /*id*/, ushort /*set*/,
+                                ushort /*clear*/);
+static void tattrgc(void);
+static void tattrwalk(uint32_t * /*map*/, int /*renumber*/);
+static uint32_t tattrhash(const Attr * /*a*/);
+static void tattrrehash(void);
 static void tsetscroll(int /*t*/, int /*b*/);
 static void tswapscreen(void);
+static void tsyncring(int /*top*/, int /*bot*/);
+static void trotate(int /*top*/, int /*bot*/, int /*n*/);
+static void tscrolldirt(int /*top*/, int /*bot*/, int /*n*/);
+static Line tline(int /*y*/);
+static int hlinelen(const Glyph * /*line*/, int /*n*/);
+static void hpush(const Glyph * /*line*/, int /*col*/);
+static void hdrop(void);
+static void hclear(void);
+static void hspill(void);
+static int hspillopen(void);
+static void hcompact(void);
+static const uchar *hdata(const HistBlock * /*b*/);
+static void hdecode(const uchar * /*p*/, Line /*line*/);
+static inline uchar *hputv(uchar * /*p*/, uint32_t /*v*/);
+static inline uchar *hputrun(uchar * /*p*/, int /*n*/, const Attr * /*a*/);
+static inline uint32_t hgetv(const uchar ** /*p*/);
+static inline void tdamage(int /*y*/, int /*x0*/, int /*x1*/);
+static inline ushort *tlinemode(int /*y*/);
 static void tsetdirt(int /*top*/, int /*bot*/);
-static void tsetdirtattr(int /*attr*/);
-static void tsetmode(char /*interm*/, int /*set*/, const int * /*args*/,
+static inline void tfill(Glyph * /*gp*/, Glyph /*g*/, int /*n*/);
+static void tsetmode(char /*priv*/, int /*set*/, const int * /*args*/,
                      int /*narg*/);
 static void tfulldirt(void);
 static void techo(Rune /*u*/);
 static void tcontrolcode(uchar /*ascii*/);
 static void tdectest(char /*c*/);
 static void tdefutf8(char /*ascii*/);
-static int32_t tdefcolor(const int * /*attr*/, int * /*npar*/, int /*l*/);
+static int32_t tdefcolor(const int * /*attr*/, int * /*npar*/, int /*l*/,
+                         int /*nsub*/);
 static void tdeftran(char /*ascii*/);
 static inline int modifiers_match(uint /*mask*/, uint /*state*/);
+#ifndef HEADLESS
 static void ttynew(void);
+static void ttynonblock(void);
+#endif
 static size_t ttyread(void);
+static size_t ttyreadsome(char * /*buf*/, size_t /*size*/);
 static void ttyresize(void);
 static void ttysend(const char * /*s*/, size_t /*n*/);
 static void ttywrite(const char * /*s*/, size_t /*n*/);
 static void tstrsequence(uchar /*c*/);
+#if defined(HEADLESS) && !defined(NDEBUG)
+static void tselftest(void);
+#endif
 
-static inline ushort sixd_to_16bit(int /*x*/);
-static int xmakeglyphfontspecs(XftGlyphFontSpec * /*specs*/,
-                               const Glyph * /*glyphs*/, int /*len*/, int /*x*/,
-                               int /*y*/);
-static Color *xgetcolor(uint32_t /*basecol*/, XRenderColor * /*rendercol*/,
-                        Color * /*truecol*/);
-static void xdrawglyphfontspecs(const XftGlyphFontSpec * /*specs*/, Glyph,
-                                int /*len*/, int /*x*/, int /*y*/);
-static void xdrawglyph(Glyph, int /*x*/, int /*y*/);
+static Attr frameattr(Glyph);
+static inline Look xlook(Glyph);
 static void xhints(void);
 static void xclear(int /*x1*/, int /*y1*/, int /*x2*/, int /*y2*/);
-static void xdrawcursor(void);
-static const char *xgetresstr(XrmDatabase /*xrmdb*/, const char * /*name*/,
-                              const char * /*xclass*/, const char * /*def*/);
-static Bool xgetresbool(XrmDatabase /*xrmdb*/, const char * /*name*/,
-                        const char * /*xclass*/, Bool);
-static void xinit(int argc, char *argv[]);
-static int xloadcolor(int /*i*/, const char * /*name*/, Color * /*ncolor*/);
 static void xloadcols(void);
 static int xsetcolorname(int /*x*/, const char * /*name*/);
 static int xgeommasktogravity(int /*mask*/);
@@ -474,19 +759,45 @@ static void xloadfonts(const char * /*fontstr*/, double /*fontsize*/);
 static void xsettitle(const char * /*p*/);
 static void xresettitle(void);
 static void xsetpointermotion(int /*set*/);
-static void xseturgency(int /*add*/);
+static void xbell(void);
+static void xsetcols(int /*cols*/);
 static void xsetsel(char * /*str*/, Bool, Time /*t*/);
 static void xunloadfont(Font *);
 static void xunloadfonts(void);
 static void xresize(int /*col*/, int /*row*/);
+#ifndef HEADLESS
+static inline ushort sixd_to_16bit(int /*x*/);
+static int xmakeglyphfontspecs(XftGlyphFontSpec * /*specs*/,
+                               const Glyph * /*glyphs*/,
+                               const Attr * /*attrs*/, int /*len*/, int /*x*/,
+                               int /*y*/);
+static Color *xgetcolor(uint32_t /*basecol*/, XRenderColor * /*rendercol*/,
+                        Color * /*truecol*/);
+static void xdrawglyphfontspecs(const XftGlyphFontSpec * /*specs*/, Attr,
+                                int /*len*/, int /*x*/, int /*y*/);
+static void xdrawglyph(Rune, Attr, int /*x*/, int /*y*/);
+static void xsnapruns(const Glyph * /*line*/, int * /*x0*/, int * /*x1*/);
+static void xdrawline(const Glyph * /*line*/, int /*x1*/, int /*x2*/,
+                      int /*y*/);
+static void xdrawcursor(void);
+static const char *xgetresstr(XrmDatabase /*xrmdb*/, const char * /*name*/,
+                              const char * /*xclass*/, const char * /*def*/);
+static Bool xgetresbool(XrmDatabase /*xrmdb*/, const char * /*name*/,
+                        const char * /*xclass*/, Bool);
+static void xinit(int argc, char *argv[]);
+static int xloadcolor(int /*i*/, const char * /*name*/, Color * /*ncolor*/);
+static void xseturgency(int /*add*/);
+#endif
 
+static void cresize(int /*width*/, int /*height*/);
+static void selclear(XEvent * /*unused*/);
+#ifndef HEADLESS
 static void expose(XEvent * /*unused*/);
 static void visibility(XEvent * /*ev*/);
 static void unmap(XEvent * /*unused*/);
 static const char *kmap(KeySym /*k*/, uint /*state*/);
 static void kpress(XEvent * /*ev*/);
 static void cmessage(XEvent * /*e*/);
-static void cresize(int /*width*/, int /*height*/);
 static void resize(XEvent * /*e*/);
 static void focus(XEvent * /*ev*/);
 static void brelease(XEvent * /*e*/);
@@ -494,36 +805,69 @@ static void bpress(XEvent * /*e*/);
 static void bmotion(XEvent * /*e*/);
 static void propnotify(XEvent * /*e*/);
 static void selnotify(XEvent * /*e*/);
-static void selclear(XEvent * /*unused*/);
 static void selrequest(XEvent * /*e*/);
+#endif
 
-static void selinit(void);
 static void selnormalize(void);
 static inline int selected(int /*x*/, int /*y*/);
+static int selectedspan(int /*x1*/, int /*x2*/, int /*y*/);
 static char *getsel(void);
-static void selcopy(Time /*t*/);
 static void selscroll(int /*orig*/, int /*n*/);
 static void selsnap(int * /*x*/, int * /*y*/, int /*direction*/);
+#ifndef HEADLESS
+static void selinit(void);
+static void selcopy(Time /*t*/);
 static int x2col(int /*x*/);
 static int y2row(int /*y*/);
 static void getbuttoninfo(const XEvent * /*e*/);
 static void mousereport(const XEvent * /*e*/);
+#endif
 
 static size_t utf8decode(const char * /*c*/, size_t /*clen*/, Rune * /*u*/);
+static size_t utf8decodechar(const char * /*s*/, size_t /*len*/, Rune * /*u*/);
+static size_t utf8decodestr_scalar(const char * /*s*/, size_t /*len*/,
+                                   Rune * /*u*/, size_t * /*n*/);
+#if defined(X86_SIMD)
+static size_t utf8decodestr_sse2(const char * /*s*/, size_t /*len*/,
+                                 Rune * /*u*/, size_t * /*n*/);
+static size_t utf8decodestr_avx2(const char * /*s*/, size_t /*len*/,
+                                 Rune * /*u*/, size_t * /*n*/);
+#endif
+static size_t utf8decodestr_resolve(const char * /*s*/, size_t /*len*/,
+                                    Rune * /*u*/, size_t * /*n*/);
+#ifndef NDEBUG
+static void utf8selftest(void);
+#endif
 static Rune utf8decodebyte(uchar /*c*/, size_t * /*i*/);
 static size_t utf8encode(Rune /*u*/, char * /*c*/);
 static char utf8encodebyte(Rune /*u*/, size_t /*i*/);
 static const char *utf8strchr(const char *s, Rune u);
 static size_t utf8validate(Rune * /*u*/, size_t /*i*/);
-
-static size_t base64decode(const char * /*enc*/, uchar ** /*out*/,
-                           size_t * /*outlen*/);
+static int runewidth(Rune /*u*/);
+
+static size_t base64decode_scalar(const char * /*enc*/, size_t /*len*/,
+                                  uchar * /*out*/, size_t * /*outlen*/);
+#if defined(X86_SIMD)
+static size_t base64decode_ssse3(const char * /*enc*/, size_t /*len*/,
+                                 uchar * /*out*/, size_t * /*outlen*/);
+static size_t base64decode_avx2(const char * /*enc*/, size_t /*len*/,
+                                uchar * /*out*/, size_t * /*outlen*/);
+#endif
+static size_t base64decode_resolve(const char * /*enc*/, size_t /*len*/,
+                                   uchar * /*out*/, size_t * /*outlen*/);
+#ifndef NDEBUG
+static void base64selftest(void);
+#endif
+#ifdef HEADLESS
+static void benchbase64(void);
+#endif
 
 static ssize_t xwrite(int /*fd*/, const char * /*s*/, size_t /*len*/);
 static void *xmalloc(size_t /*len*/);
 static void *xrealloc(void * /*p*/, size_t /*len*/);
 static char *xstrdup(const char * /*s*/);
 
+#ifndef HEADLESS
 static void usage(void);
 
 // clang-format off
@@ -553,6 +897,202 @@ static void (*handler[LASTEvent])(XEvent *) = {
 	[SelectionRequest] = selrequest,
 };
 // clang-format on
+#endif
+
+// clang-format off
+/*
+ * Transitions of the escape sequence parser, from which parserinit() builds
+ * parsetable. Later rules take precedence over earlier ones. Unlike in the
+ * VT500, C0 controls other than BEL, CAN, SUB and ESC are kept in control
+ * strings, which end at BEL as well as at ST like in xterm.
+ */
+static const ParseRule parserules[] = {
+	{PS_GROUND, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_GROUND, 0x20, 0x7E, PA_PRINT, PS_STAY},
+	{PS_GROUND, PARSE_OTHER, PARSE_OTHER, PA_PRINT, PS_STAY},
+
+	{PS_ESCAPE, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_ESCAPE, 0x20, 0x2F, PA_COLLECT, PS_ESCAPE_INTERMEDIATE},
+	{PS_ESCAPE, 0x30, 0x7E, PA_ESC_DISPATCH, PS_GROUND},
+	{PS_ESCAPE, '[', '[', PA_NONE, PS_CSI_ENTRY},
+	{PS_ESCAPE, 'P', 'P', PA_STR_START, PS_STRING},  // DCS
+	{PS_ESCAPE, 'X', 'X', PA_STR_START, PS_STRING},  // SOS
+	{PS_ESCAPE, ']', ']', PA_STR_START, PS_STRING},  // OSC
+	{PS_ESCAPE, '^', '^', PA_STR_START, PS_STRING},  // PM
+	{PS_ESCAPE, '_', '_', PA_STR_START, PS_STRING},  // APC
+	{PS_ESCAPE, 'k', 'k', PA_STR_START, PS_STRING},  // old title set
+
+	{PS_ESCAPE_INTERMEDIATE, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_ESCAPE_INTERMEDIATE, 0x20, 0x2F, PA_COLLECT, PS_STAY},
+	{PS_ESCAPE_INTERMEDIATE, 0x30, 0x7E, PA_ESC_DISPATCH, PS_GROUND},
+
+	{PS_CSI_ENTRY, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_CSI_ENTRY, 0x20, 0x2F, PA_COLLECT, PS_CSI_INTERMEDIATE},
+	{PS_CSI_ENTRY, 0x30, 0x3B, PA_PARAM, PS_CSI_PARAM},
+	{PS_CSI_ENTRY, 0x3C, 0x3F, PA_COLLECT, PS_CSI_PARAM},
+	{PS_CSI_ENTRY, 0x40, 0x7E, PA_CSI_DISPATCH, PS_GROUND},
+
+	{PS_CSI_PARAM, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_CSI_PARAM, 0x20, 0x2F, PA_COLLECT, PS_CSI_INTERMEDIATE},
+	{PS_CSI_PARAM, 0x30, 0x3B, PA_PARAM, PS_STAY},
+	{PS_CSI_PARAM, 0x3C, 0x3F, PA_NONE, PS_CSI_IGNORE},
+	{PS_CSI_PARAM, 0x40, 0x7E, PA_CSI_DISPATCH, PS_GROUND},
+
+	{PS_CSI_INTERMEDIATE, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_CSI_INTERMEDIATE, 0x20, 0x2F, PA_COLLECT, PS_STAY},
+	{PS_CSI_INTERMEDIATE, 0x30, 0x3F, PA_NONE, PS_CSI_IGNORE},
+	{PS_CSI_INTERMEDIATE, 0x40, 0x7E, PA_CSI_DISPATCH, PS_GROUND},
+
+	{PS_CSI_IGNORE, 0x00, 0x1F, PA_EXECUTE, PS_STAY},
+	{PS_CSI_IGNORE, 0x40, 0x7E, PA_NONE, PS_GROUND},
+
+	{PS_STRING, 0x00, PARSE_OTHER, PA_STR_PUT, PS_STAY},
+
+	{PS_ANYWHERE, 0x18, 0x18, PA_EXECUTE, PS_GROUND},  // CAN
+	{PS_ANYWHERE, 0x1A, 0x1A, PA_EXECUTE, PS_GROUND},  // SUB
+	{PS_ANYWHERE, 0x1B, 0x1B, PA_NONE, PS_ESCAPE},
+	{PS_ANYWHERE, 0x80, 0x9F, PA_EXECUTE, PS_GROUND},
+	{PS_ANYWHERE, 0x90, 0x90, PA_STR_START, PS_STRING},  // DCS
+	{PS_ANYWHERE, 0x98, 0x98, PA_STR_START, PS_STRING},  // SOS
+	{PS_ANYWHERE, 0x9B, 0x9B, PA_NONE, PS_CSI_ENTRY},
+	{PS_ANYWHERE, 0x9C, 0x9C, PA_NONE, PS_GROUND},  // ST
+	{PS_ANYWHERE, 0x9D, 0x9F, PA_STR_START, PS_STRING},  // OSC, PM, APC
+
+	{PS_STRING, '\a', '\a', PA_STR_DISPATCH, PS_GROUND},
+	{PS_STRING, 0x1B, 0x1B, PA_STR_DISPATCH, PS_ESCAPE},
+	{PS_STRING, 0x9C, 0x9C, PA_STR_DISPATCH, PS_GROUND},
+};
+
+// Actions performed on entering a state.
+static const uchar parseentry[PS_NUM] = {
+	[PS_ESCAPE] = PA_CLEAR,
+	[PS_CSI_ENTRY] = PA_CLEAR,
+};
+
+/*
+ * Supported control sequences, from which parserinit() builds csitable.
+ * Private markers, intermediates and finals not listed here are unknown.
+ */
+static const CSIHandler csihandlers[] = {
+	{0, 0, '@', csiich},  // ICH -- Insert <n> blank char
+	{0, 0, 'A', csicuu},  // CUU -- Cursor <n> Up
+	{0, 0, 'B', csicud},  // CUD -- Cursor <n> Down
+	{0, 0, 'e', csicud},  // VPR -- Cursor <n> Down
+	{0, 0, 'C', csicuf},  // CUF -- Cursor <n> Forward
+	{0, 0, 'a', csicuf},  // HPR -- Cursor <n> Forward
+	{0, 0, 'D', csicub},  // CUB -- Cursor <n> Backward
+	{0, 0, 'E', csicnl},  // CNL -- Cursor <n> Down and first col
+	{0, 0, 'F', csicpl},  // CPL -- Cursor <n> Up and first col
+	{0, 0, 'G', csicha},  // CHA -- Move to <col>
+	{0, 0, '`', csicha},  // HPA
+	{0, 0, 'H', csicup},  // CUP -- Move to <row> <col>
+	{0, 0, 'f', csicup},  // HVP
+	{0, 0, 'I', csicht},  // CHT -- Cursor Forward Tabulation <n> tab stops
+	{0, 0, 'J', csied},   // ED -- Clear screen
+	{'?', 0, 'J', csied}, // DECSED -- Selective clear screen
+	{0, 0, 'K', csiel},   // EL -- Clear line
+	{'?', 0, 'K', csiel}, // DECSEL -- Selective clear line
+	{0, 0, 'L', csiil},   // IL -- Insert <n> blank lines
+	{0, 0, 'M', csidl},   // DL -- Delete <n> lines
+	{0, 0, 'P', csidch},  // DCH -- Delete <n> char
+	{0, 0, 'S', csisu},   // SU -- Scroll <n> line up
+	{0, 0, 'T', csisd},   // SD -- Scroll <n> line down
+	{0, 0, 'X', csiech},  // ECH -- Erase <n> char
+	{0, 0, 'Z', csicbt},  // CBT -- Cursor Backward Tabulation <n> tab stops
+	{0, 0, 'c', csida},   // DA -- Device Attributes
+	{'>', 0, 'c', csida2},  // Secondary DA -- Device Attributes
+	{0, 0, 'd', csivpa},  // VPA -- Move to <row>
+	{0, 0, 'g', csitbc},  // TBC -- Tabulation clear
+	{0, 0, 'h', csism},   // SM -- Set terminal mode
+	{'?', 0, 'h', csism}, // DECSET -- Set private mode
+	{0, 0, 'i', csimc},   // MC -- Media Copy
+	{'?', 0, 'i', csimc}, // MC -- Media Copy (DEC)
+	{0, 0, 'l', csirm},   // RM -- Reset Mode
+	{'?', 0, 'l', csirm}, // DECRST -- Reset private mode
+	{0, 0, 'm', csisgr, 1},  // SGR -- Terminal attribute (color)
+	{'>', 0, 'm', csiignore},  // Set/reset modify keys (IGNORED)
+	{0, 0, 'n', csidsr},  // DSR -- Device Status Report
+	{'?', 0, 'n', csidsr},  // DECDSR -- Device Status Report (DEC)
+	{'>', 0, 'n', csiignore},  // Disable modify keys (IGNORED)
+	{0, 0, 'r', csidecstbm},  // DECSTBM -- Set Scrolling Region
+	{0, 0, 's', csidecsc},  // DECSC -- Save cursor position (ANSI.SYS)
+	{0, 0, 'u', csidecrc},  // DECRC -- Restore cursor position (ANSI.SYS)
+	{0, ' ', 'q', csidecscusr},  // DECSCUSR -- Set Cursor Style
+	{0, '$', '|', csidecscpp},  // DECSCPP -- Select Columns Per Page
+	{0, '$', '~', csidecssdt},  // DECSSDT -- Select Status Display Type
+	{0, '$', 'p', csidecrqm},  // DECRQM -- Request Mode
+	{'?', '$', 'p', csidecrqm},  // DECRQM -- Request Mode (DEC)
+};
+// clang-format on
+
+// Built by parserinit().
+static Transition parsetable[PS_NUM][PARSE_OTHER + 1];
+// Indexes in csihandlers plus one, by private marker, intermediate and final.
+static uchar csitable[5][17][63];
+
+// Translations of the characters from ' ' to 0x7F, 0 for none.
+static const struct {
+	enum charset charset;
+	const Rune table[96];
+} charset_to_table[] = {
+    {CS_SPECIAL_GRAPHIC,
+     {0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      0,
+      0,      0,      0,      0,      0,      0,      0,      ' ',
+      0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0xB0,   0xB1,
+      0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+      0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+      0x2502, 0x2264, 0x2265, 0x3C0,  0x2260, 0xA3,   0xB7,   0}},
+    {CS_TECHNICAL,
+     // NOTE: 0x2B to 0x2E had been 0x239B, 0x239D, 0x239E, and 0x23A0,
+     // but the new code points look closer to the original. 0x44 had
+     // been 0x0394, but 0x2206 makes more sense.
+     {0,      0x23B7, 0x250C, 0x2500, 0x2320, 0x2321, 0x2502, 0x23A1,
+      0x23A3, 0x23A4, 0x23A6, 0x23A7, 0x23A9, 0x23AB, 0x23AD, 0x23A8,
+      0x23AC, '<',    '<',    0x2572, 0x2571, '-',    '-',    '>',
+      0x2426, 0x2426, 0x2426, 0x2426, 0x2264, 0x2260, 0x2265, 0x222B,
+      0x2234, 0x221D, 0x221E, 0xF7,   0x2206, 0x2207, 0x3A6,  0x393,
+      0x223C, 0x2243, 0x398,  0xD7,   0x39B,  0x21D4, 0x21D2, 0x2261,
+      0x3A0,  0x3A8,  0x2426, 0x3A3,  0x2426, 0x2426, 0x221A, 0x3A9,
+      0x39E,  0x3A5,  0x2282, 0x2283, 0x2229, 0x222A, 0x2227, 0x2228,
+      0xAC,   0x3B1,  0x3B2,  0x3C7,  0x3B4,  0x3B5,  0x3C6,  0x3B3,
+      0x3B7,  0x3B9,  0x3B8,  0x3BA,  0x3BB,  0x2426, 0x3BD,  0x2202,
+      0x3C0,  0x3C8,  0x3C1,  0x3C3,  0x3C4,  0x2426, 0x192,  0x3C9,
+      0x3BE,  0x3C5,  0x3B6,  0x2190, 0x2191, 0x2192, 0x2193, 0}},
+    {CS_CURSES,
+     // These are similar to special_graphics but with previously
+     // unchanged characters changed to either blanks or new characters,
+     // particularly for use in curses.
+     {0,      ' ',    ' ',    0x25A0, 0xA7,   ' ',    0x2603, ' ',
+      ' ',    ' ',    ' ',    0x2192, 0x2190, 0x2191, 0x2193, ' ',
+      0x2588, ' ',    ' ',    ' ',    ' ',    ' ',    ' ',    ' ',
+      ' ',    ' ',    ' ',    ' ',    0x2591, ' ',    0x2593, ' ',
+      ' ',    0x255D, 0x2557, 0x2554, 0x255A, 0x256C, 0x2560, 0x2563,
+      0x2569, 0x2566, 0x251B, 0x2513, 0x250F, 0x2517, 0x254B, ' ',
+      ' ',    0x2501, 0x2550, ' ',    0x2523, 0x252B, 0x253B, 0x2533,
+      0x2503, 0x2551, ' ',    ' ',    ' ',    ' ',    ' ',    ' ',
+      0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0xB0,   0xB1,
+      0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+      0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+      0x2502, 0x2264, 0x2265, 0x3C0,  0x2260, 0xA3,   0xB7,   0}},
+};
+
+// Set by tspecialize() for the current modes and charsets.
+static void (*tputc)(Rune) = tputcparse;
+static void (*tputglyph)(Rune) = tputglyphany;
+static const Rune *trantbl;  // translations of the charset in use, or NULL
+static int tputasciiok;      // whether tputascii() can write
+
+// Set to the best implementation for this CPU on first use.
+static size_t (*utf8decodestr)(const char *, size_t, Rune *,
+                               size_t *) = utf8decodestr_resolve;
+static size_t (*base64decode)(const char *, size_t, uchar *,
+                              size_t *) = base64decode_resolve;
 
 // Globals
 static DC dc;
@@ -561,27 +1101,78 @@ static Term term;
 static CSIEscape csiescseq;
 static STREscape strescseq;
 static int cmdfd;
+#ifndef HEADLESS
 static pid_t pid;
+#endif
 static Selection sel;
+static History hist = {.fd = -1};
 static int iofd = 1;
+// Output for iofd, written out by tprinterflush().
+static struct {
+	char buf[PRINT_BUF_SIZ];
+	size_t len;
+} printbuf;
 static int opt_allowaltscreen;
-static const char **opt_cmd = NULL;
 static const char *opt_class = NULL;
 static unsigned int opt_cols = cols;
-static const char *opt_embed = NULL;
-static const char *opt_font = NULL;
 static const char *opt_io = NULL;
 static const char *opt_iso14755_cmd = NULL;
-static const char *opt_line = NULL;
 static const char *opt_name = NULL;
 static unsigned int opt_rows = rows;
 static const char *opt_title = NULL;
+#ifndef HEADLESS
+static const char **opt_cmd = NULL;
+static const char *opt_embed = NULL;
+static const char *opt_font = NULL;
+static const char *opt_line = NULL;
 static int oldbutton = 3;  // button event on startup: 3 = release
+#endif
 
 static const char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
+#ifndef HEADLESS
 static int exit_with_code = -1;
+#endif
+
+/*
+ * The tty thread reads and parses the output of the shell, and the main thread
+ * handles X events and draws. termlock guards the terminal and the tty, and
+ * xlock guards X and the drawing state. When both are needed, termlock is
+ * taken first. The screen goes from one thread to the other through three
+ * frames: tpublish() fills frames[frameback] and swaps it with the middle
+ * one, and draw() swaps frames[framefront] with the middle one when it is
+ * newer, without either waiting for the other.
+ */
+#define FRAME_REVERSE (1u << 31)  // set in the attr of selected frame glyphs
+static pthread_mutex_t xlock;  // recursive
+static Frame frames[3];
+static Frame *frame = &frames[2];  // frame being drawn
+#ifndef HEADLESS
+#define FRAME_NEW 4  // the middle frame is newer than the front one
+static pthread_mutex_t termlock = PTHREAD_MUTEX_INITIALIZER;
+static int frameback = 0, framemid = 1, framefront = 2;
+static int framefd[2];  // written to by the tty thread after each frame
+#endif
+static int ttyclosed;   // whether the shell hung up
+// What has been drawn so far
+static struct {
+	int row, col;
+	int mode;            // MODE_REVERSE of the frame drawn
+	int rowcap, colcap;  // room in gen, looks and specbuf
+	ulong *gen;          // generation of the lines drawn, or 0
+	Look *looks;         // glyphs drawn, col by row
+	XftGlyphFontSpec *specbuf;
+} drawn;
+
+// Statistics of the tty input, to tune the tty buffer settings and the parser.
+static struct {
+	ulong wakeups;    // calls of ttyread()
+	ulong bytes;      // bytes read
+	ulong maxbytes;   // most bytes read in a call
+	ulong runes;      // characters decoded
+	ulong sequences;  // escape sequences and control strings handled
+} ttystats;
 
 static uchar utfbyte[] = {0x80, 0, 0xC0, 0xE0, 0xF0};
 static uchar utfmask[] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -791,17 +1382,332 @@ utf8validate(Rune *u, size_t i)
 	return i;
 }
 
+/*
+ * Decodes a single character the way the terminal reads it, which is
+ * utf8decode() plus the handling of C1 controls chosen by c1utf8_as.
+ * Returns the number of bytes consumed, or 0 if the sequence is incomplete.
+ */
+size_t
+utf8decodechar(const char *s, size_t len, Rune *u)
+{
+	size_t n;
+
+	if ((c1utf8_as & C1UTF8_AS_BYTE) && len > 0 &&
+	    ISCONTROLC1((uchar)s[0])) {
+		// We aren't able to decode as UTF-8 because it's actually a
+		// control code.
+		*u = (uchar)s[0];
+		return 1;
+	}
+	n = utf8decode(s, len, u);
+	if (n != 0 && !(c1utf8_as & C1UTF8_AS_UTF8) && ISCONTROLC1(*u)) {
+		// We don't accept C1 controls in UTF-8 form.
+		*u = replacement_rune;
+	}
+
+	return n;
+}
+
+/*
+ * Decodes the bytes in s into at most *n runes, stopping early at an
+ * incomplete sequence at the end. Sets *n to the number of runes decoded and
+ * returns the number of bytes they came from. All the implementations below
+ * must give exactly the same results as this one.
+ */
+size_t
+utf8decodestr_scalar(const char *s, size_t len, Rune *u, size_t *n)
+{
+	size_t i, j, k;
+
+	for (i = 0, j = 0; i < len && j < *n; i += k, ++j) {
+		if ((k = utf8decodechar(&s[i], len - i, &u[j])) == 0) {
+			break;
+		}
+	}
+	*n = j;
+
+	return i;
+}
+
+#if defined(X86_SIMD)
+// Plain ASCII is widened 16 bytes at a time; anything else is decoded by
+// utf8decodechar().
+__attribute__((target("sse2"))) size_t
+utf8decodestr_sse2(const char *s, size_t len, Rune *u, size_t *n)
+{
+	size_t i = 0, j = 0, k;
+	__m128i v, lo, hi, zero = _mm_setzero_si128();
+	int mask;
+
+	while (i < len && j < *n) {
+		if (len - i >= 16 && *n - j >= 16) {
+			v = _mm_loadu_si128((const __m128i *)&s[i]);
+			if ((mask = _mm_movemask_epi8(v)) == 0) {
+				lo = _mm_unpacklo_epi8(v, zero);
+				hi = _mm_unpackhi_epi8(v, zero);
+				_mm_storeu_si128((__m128i *)&u[j],
+				                 _mm_unpacklo_epi16(lo, zero));
+				_mm_storeu_si128((__m128i *)&u[j + 4],
+				                 _mm_unpackhi_epi16(lo, zero));
+				_mm_storeu_si128((__m128i *)&u[j + 8],
+				                 _mm_unpacklo_epi16(hi, zero));
+				_mm_storeu_si128((__m128i *)&u[j + 12],
+				                 _mm_unpackhi_epi16(hi, zero));
+				i += 16;
+				j += 16;
+				continue;
+			}
+			// copy the ASCII bytes before the first non-ASCII one
+			for (; !(mask & 1); mask >>= 1) {
+				u[j++] = (uchar)s[i++];
+			}
+		}
+		if ((k = utf8decodechar(&s[i], len - i, &u[j])) == 0) {
+			break;
+		}
+		i += k;
+		++j;
+	}
+	*n = j;
+
+	return i;
+}
+
+/*
+ * On top of widening 32 ASCII bytes at a time, runs of well-formed two and
+ * three byte sequences (accented Latin, Greek, Cyrillic, CJK...) are decoded
+ * four characters at a time. Sequences the kernels aren't sure about, such as
+ * overlong forms, surrogates or C1 controls, are left to utf8decodechar().
+ */
+__attribute__((target("avx2"))) size_t
+utf8decodestr_avx2(const char *s, size_t len, Rune *u, size_t *n)
+{
+	size_t i = 0, j = 0, k;
+	__m256i w;
+	__m128i v, t, r;
+	int mask;
+
+	// lane k holds the bytes of the k-th character, first byte highest
+	const __m128i shuf2 = _mm_setr_epi8(1, 0, -1, -1, 3, 2, -1, -1, 5, 4,
+	                                    -1, -1, 7, 6, -1, -1);
+	const __m128i shuf3 = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6,
+	                                    -1, 11, 10, 9, -1);
+	const __m128i low5 = _mm_set1_epi32(0x1F);
+	const __m128i low6 = _mm_set1_epi32(0x3F);
+
+	while (i < len && j < *n) {
+		if (len - i >= 32 && *n - j >= 32) {
+			w = _mm256_loadu_si256((const __m256i *)&s[i]);
+			if (_mm256_movemask_epi8(w) == 0) {
+				for (k = 0; k < 32; k += 8) {
+					v = _mm_loadl_epi64(
+					    (const __m128i *)&s[i + k]);
+					_mm256_storeu_si256(
+					    (__m256i *)&u[j + k],
+					    _mm256_cvtepu8_epi32(v));
+				}
+				i += 32;
+				j += 32;
+				continue;
+			}
+		}
+		if (len - i >= 16 && *n - j >= 16) {
+			v = _mm_loadu_si128((const __m128i *)&s[i]);
+			mask = _mm_movemask_epi8(v);
+			if (!(mask & 1)) {
+				// copy the ASCII bytes before the first
+				// non-ASCII one
+				for (k = 0; k < 16 && !(mask & 1); ++k) {
+					u[j++] = (uchar)s[i++];
+					mask >>= 1;
+				}
+				continue;
+			}
+
+			t = _mm_shuffle_epi8(v, shuf3);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+			        _mm_and_si128(t, _mm_set1_epi32(0xF0C0C0)),
+			        _mm_set1_epi32(0xE08080))) == 0xFFFF) {
+				r = _mm_or_si128(
+				    _mm_slli_epi32(
+				        _mm_and_si128(_mm_srli_epi32(t, 16),
+				                      _mm_set1_epi32(0x0F)),
+				        12),
+				    _mm_slli_epi32(
+				        _mm_and_si128(_mm_srli_epi32(t, 8),
+				                      low6),
+				        6));
+				r = _mm_or_si128(r, _mm_and_si128(t, low6));
+				// reject overlong forms and surrogates
+				t = _mm_or_si128(
+				    _mm_cmplt_epi32(r, _mm_set1_epi32(0x800)),
+				    _mm_cmpeq_epi32(
+				        _mm_and_si128(r,
+				                      _mm_set1_epi32(0xF800)),
+				        _mm_set1_epi32(0xD800)));
+				if (_mm_movemask_epi8(t) == 0) {
+					_mm_storeu_si128((__m128i *)&u[j], r);
+					i += 12;
+					j += 4;
+					continue;
+				}
+			}
+
+			t = _mm_shuffle_epi8(v, shuf2);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+			        _mm_and_si128(t, _mm_set1_epi32(0xE0C0)),
+			        _mm_set1_epi32(0xC080))) == 0xFFFF) {
+				r = _mm_and_si128(_mm_srli_epi32(t, 8), low5);
+				r = _mm_slli_epi32(r, 6);
+				r = _mm_or_si128(r, _mm_and_si128(t, low6));
+				// reject overlong forms and C1 controls
+				t = _mm_cmplt_epi32(r, _mm_set1_epi32(0xA0));
+				if (_mm_movemask_epi8(t) == 0) {
+					_mm_storeu_si128((__m128i *)&u[j], r);
+					i += 8;
+					j += 4;
+					continue;
+				}
+			}
+		}
+		if ((k = utf8decodechar(&s[i], len - i, &u[j])) == 0) {
+			break;
+		}
+		i += k;
+		++j;
+	}
+	*n = j;
+
+	return i;
+}
+#endif
+
+/*
+ * Picks the fastest implementation of utf8decodestr() the CPU supports the
+ * first time it's called.
+ */
+size_t
+utf8decodestr_resolve(const char *s, size_t len, Rune *u, size_t *n)
+{
+	utf8decodestr = utf8decodestr_scalar;
+#if defined(X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		utf8decodestr = utf8decodestr_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		utf8decodestr = utf8decodestr_sse2;
+	}
+#endif
+
+	return utf8decodestr(s, len, u, n);
+}
+
+#ifndef NDEBUG
+/*
+ * Checks that every implementation of utf8decodestr() agrees with the scalar
+ * one on a few tricky inputs, at every alignment and cut at every length.
+ */
+void
+utf8selftest(void)
+{
+	static const char *vectors[] = {
+	    "plain ASCII text that is longer than a single SIMD block......",
+	    "\xC3\xA9t\xC3\xA9 \xC3\xA0 \xC3\xA9t\xC3\xA9 \xC3\xA0 "
+	    "\xC3\xA9t\xC3\xA9 \xCE\xB1\xCE\xB2\xCE\xB3\xCE\xB4\xD0\x96"
+	    "\xD0\x96",
+	    "\xE6\xBC\xA2\xE5\xAD\x97\xE6\xBC\xA2\xE5\xAD\x97\xE6\xBC\xA2"
+	    "\xE5\xAD\x97\xE6\xBC\xA2\xE5\xAD\x97\xE3\x81\x82\xE3\x81\x84",
+	    "\xF0\x9F\x98\x80\xF0\x9F\x98\x81 \xF4\x8F\xBF\xBF\xF4\x90\x80\x80"
+	    "\xF5\x80\x80\x80\xF8\x88\x80\x80\x80",
+	    // overlong forms and surrogates
+	    "\xC0\x80\xC1\xBF\xC2\x80\xE0\x80\x80\xE0\x9F\xBF\xED\xA0\x80"
+	    "\xED\xBF\xBF\xF0\x80\x80\x80\xE0\xA0\x80\xE0\xA0\x80\xE0\xA0",
+	    // C1 controls as bytes and as UTF-8
+	    "\x1B[1mbold\x9B" "31m\xC2\x9B" "32m\x90q\x9C\xC2\x90q\xC2\x9C"
+	    "\xC2\x9F\xC2\xA0\xC2\xA0\xC2\xA0\xC2\xA0\xC2\xA0",
+	    // stray continuation bytes and truncated sequences
+	    "\x80\xBF\xE6\xBC\xE6\xBC\xA2\xC3\xC3\xA9\xF0\x9F\x98"
+	    "\xE6\xBC\xA2\xE6\xBC\xA2\xE6\xBC\xA2\xE6\xBC\xA2\xE6\xBC",
+	    "\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9\xE6\xBC\xA2\xE6\xBC\xA2\xE6"
+	    "\xBC\xA2\xE6\xBC\xA2\xC3\xA9\xC3\xA9\xC3\xA9\xC3\xA9x",
+	};
+	size_t (*impls[2])(const char *, size_t, Rune *, size_t *);
+	char buf[512];
+	Rune want[LEN(buf)], got[LEN(buf)];
+	size_t i, j, k, off, len, nimpls = 0, wantn, gotn, wantlen, gotlen;
+
+#if defined(X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		impls[nimpls++] = utf8decodestr_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		impls[nimpls++] = utf8decodestr_avx2;
+	}
+#endif
+	for (i = 0; i < LEN(vectors); ++i) {
+		for (off = 0; off < 32; ++off) {
+			// repeat the vector to exercise the block loops
+			for (j = 0; j < 4; ++j) {
+				memcpy(&buf[off + j * strlen(vectors[i])],
+				       vectors[i], strlen(vectors[i]));
+			}
+			for (len = 0; len <= 4 * strlen(vectors[i]); ++len) {
+				wantn = LEN(want);
+				wantlen = utf8decodestr_scalar(&buf[off], len,
+				                               want, &wantn);
+				for (k = 0; k < nimpls; ++k) {
+					gotn = LEN(got);
+					gotlen = impls[k](&buf[off], len, got,
+					                  &gotn);
+					assert(gotlen == wantlen);
+					assert(gotn == wantn);
+					assert(!memcmp(got, want,
+					               wantn * sizeof(Rune)));
+				}
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Returns the number of cells taken by a character, or -1 if it isn't
+ * printable. Unlike wcwidth(), it doesn't depend on the locale, and East
+ * Asian ambiguous characters take ambiguouswidth cells.
+ */
+int
+runewidth(Rune u)
+{
+	int w;
+
+	if (u < 0x7F) {
+		return u >= 0x20 ? 1 : -1;
+	}
+	if (u > 0x10FFFF) {
+		return -1;
+	}
+	w = widthblocks[widthindex[u / WIDTH_BLOCK]][u % WIDTH_BLOCK];
+	if (w == WIDTH_AMBIGUOUS) {
+		return ambiguouswidth;
+	}
+	return w == WIDTH_NONPRINT ? -1 : w;
+}
+
+/*
+ * Decodes the base64 in the first len bytes of enc, up to the first byte that
+ * isn't base64, into out. It must have room for len / 4 * 3 + 3 bytes. Returns
+ * the number of bytes decoded and sets *outlen to the number of bytes written.
+ */
 size_t
-base64decode(const char *enc, uchar **out, size_t *outlen)
+base64decode_scalar(const char *enc, size_t len, uchar *out, size_t *outlen)
 {
-	size_t i, enclen = strlen(enc);
-	uchar *current;
+	size_t i;
+	uchar *current = out;
 
-	*out = (uchar *)xmalloc((enclen * 3) / 4 + 1);
-	current = *out;
 	*outlen = 0;
 
-	for (i = 0; i < enclen; ++i) {
+	for (i = 0; i < len; ++i) {
 		uchar x = base64decode_table[(uchar)enc[i]];
 		if (x >= '@') {
 			break;
@@ -827,58 +1733,231 @@ base64decode(const char *enc, uchar **out, size_t *outlen)
 			break;
 		}
 	}
-	while (enc[i] == '=') {
-		++i;
-	}
-	*current = 0;
-	*outlen = current - *out;
+	*outlen = current - out;
 	return i;
 }
 
-void
-selinit(void)
-{
-	clock_gettime(CLOCK_MONOTONIC, &sel.tclick1);
-	clock_gettime(CLOCK_MONOTONIC, &sel.tclick2);
-	sel.mode = SEL_IDLE;
-	sel.snap = 0;
-	sel.ob.x = -1;
-	sel.primary = NULL;
-	sel.clipboard = NULL;
-	sel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
-	if (sel.xtarget == None) {
-		sel.xtarget = XA_STRING;
+#if defined(X86_SIMD)
+/*
+ * Checks and decodes 16 characters at a time: a character is valid if the
+ * entries of its low and high nibbles in lutlo and luthi share no bit, and its
+ * value is the character plus the entry of its high nibble in lutroll, with
+ * '/' moved down a slot. See
+ * http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html.
+ */
+__attribute__((target("ssse3"))) size_t
+base64decode_ssse3(const char *enc, size_t len, uchar *out, size_t *outlen)
+{
+	const __m128i lutlo =
+	    _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                  0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i luthi =
+	    _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10,
+	                  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lutroll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+	                                      0, 0, 0, 0, 0, 0, 0, 0);
+	// the three bytes of each group of four, first byte first
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+	                                   12, -1, -1, -1, -1);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i v, hi, lo;
+	size_t i, n;
+
+	// each store writes 16 bytes for 12, so stay clear of the end
+	for (i = 0; len - i >= 24; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&enc[i]);
+		hi = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+		lo = _mm_and_si128(v, nibble);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+		        _mm_and_si128(_mm_shuffle_epi8(lutlo, lo),
+		                      _mm_shuffle_epi8(luthi, hi)),
+		        _mm_setzero_si128())) != 0xFFFF) {
+			break;
+		}
+		hi = _mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi);
+		v = _mm_add_epi8(v, _mm_shuffle_epi8(lutroll, hi));
+		// merge the 6 bit values into 12 bit pairs, then 24 bit groups
+		v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)&out[i / 4 * 3],
+		                 _mm_shuffle_epi8(v, pack));
+	}
+	n = base64decode_scalar(&enc[i], len - i, &out[i / 4 * 3], outlen);
+	*outlen += i / 4 * 3;
+
+	return i + n;
+}
+
+// The same as base64decode_ssse3(), 32 characters at a time.
+__attribute__((target("avx2"))) size_t
+base64decode_avx2(const char *enc, size_t len, uchar *out, size_t *outlen)
+{
+	const __m256i lutlo = _mm256_setr_epi8(
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+	    0x1A, 0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i luthi = _mm256_setr_epi8(
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+	    0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lutroll = _mm256_setr_epi8(
+	    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19,
+	    4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(
+	    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6,
+	    5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	// the 12 bytes of each lane next to each other
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i v, hi, lo;
+	size_t i, n;
+
+	// each store writes 32 bytes for 24, so stay clear of the end
+	for (i = 0; len - i >= 44; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)&enc[i]);
+		hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+		lo = _mm256_and_si256(v, nibble);
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lutlo, lo),
+		                        _mm256_shuffle_epi8(luthi, hi))) {
+			break;
+		}
+		hi = _mm256_add_epi8(
+		    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), hi);
+		v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lutroll, hi));
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack),
+		                                lanes);
+		_mm256_storeu_si256((__m256i *)&out[i / 4 * 3], v);
 	}
+	n = base64decode_ssse3(&enc[i], len - i, &out[i / 4 * 3], outlen);
+	*outlen += i / 4 * 3;
+
+	return i + n;
 }
+#endif
 
-int
-x2col(int x)
+/*
+ * Picks the fastest implementation of base64decode() the CPU supports the
+ * first time it's called.
+ */
+size_t
+base64decode_resolve(const char *enc, size_t len, uchar *out, size_t *outlen)
 {
-	x -= borderpx;
-	x /= xw.cw;
+	base64decode = base64decode_scalar;
+#if defined(X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		base64decode = base64decode_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		base64decode = base64decode_ssse3;
+	}
+#endif
 
-	return LIMIT(x, 0, term.col - 1);
+	return base64decode(enc, len, out, outlen);
 }
 
-int
-y2row(int y)
-{
+#ifndef NDEBUG
+/*
+ * Checks that every implementation of base64decode() agrees with the scalar
+ * one, with an invalid character at every position, at every alignment and cut
+ * at every length.
+ */
+void
+base64selftest(void)
+{
+	static const char alphabet[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char invalid[] = "=-_ \n\x80\xFF";
+	size_t (*impls[2])(const char *, size_t, uchar *, size_t *);
+	char enc[160];
+	uchar want[LEN(enc)], got[LEN(enc)];
+	size_t i, j, k, len, nimpls = 0, wantn, gotn, wantlen, gotlen;
+
+#if defined(X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		impls[nimpls++] = base64decode_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		impls[nimpls++] = base64decode_avx2;
+	}
+#endif
+	for (i = 0; i < LEN(enc); ++i) {
+		enc[i] = alphabet[(i * 7 + i / 64) % 64];
+	}
+	for (i = 0; i <= 128; ++i) {
+		// i == 128 leaves the input valid
+		if (i < 128) {
+			enc[i] = invalid[i % (LEN(invalid) - 1)];
+		}
+		for (j = 0; j < 32; j += 3) {
+			for (len = 0; j + len <= LEN(enc); len += 1 + len / 16) {
+				wantlen = base64decode_scalar(&enc[j], len, want,
+				                              &wantn);
+				for (k = 0; k < nimpls; ++k) {
+					gotlen = impls[k](&enc[j], len, got,
+					                  &gotn);
+					assert(gotlen == wantlen);
+					assert(gotn == wantn);
+					assert(!memcmp(got, want, wantn));
+				}
+			}
+		}
+		if (i < 128) {
+			enc[i] = alphabet[(i * 7 + i / 64) % 64];
+		}
+	}
+}
+#endif
+
+#ifndef HEADLESS
+void
+selinit(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &sel.tclick1);
+	clock_gettime(CLOCK_MONOTONIC, &sel.tclick2);
+	sel.mode = SEL_IDLE;
+	sel.snap = 0;
+	sel.ob.x = -1;
+	sel.primary = NULL;
+	sel.clipboard = NULL;
+	sel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
+	if (sel.xtarget == None) {
+		sel.xtarget = XA_STRING;
+	}
+}
+
+int
+x2col(int x)
+{
+	x -= borderpx;
+	x /= xw.cw;
+
+	return LIMIT(x, 0, term.col - 1);
+}
+
+int
+y2row(int y)
+{
 	y -= borderpx;
 	y /= xw.ch;
 
 	return LIMIT(y, 0, term.row - 1);
 }
+#endif
 
 int
 tlinelen(int y)
 {
 	int i = term.col;
+	const Glyph *line = tline(y);
 
-	if (term.line[y][i - 1].mode & ATTR_WRAP) {
+	if (ATTRMODE(line[i - 1]) & ATTR_WRAP) {
 		return i;
 	}
 
-	while (i > 0 && term.line[y][i - 1].u == ' ') {
+	while (i > 0 && line[i - 1].u == ' ') {
 		--i;
 	}
 
@@ -933,11 +2012,28 @@ selected(int x, int y)
 	       (y != sel.ne.y || x <= sel.ne.x);
 }
 
+// Returns whether any of the columns x1 to x2 of line y is selected.
+int
+selectedspan(int x1, int x2, int y)
+{
+	if (sel.mode == SEL_EMPTY || !BETWEEN(y, sel.nb.y, sel.ne.y)) {
+		return 0;
+	}
+
+	if (sel.type == SEL_RECTANGULAR) {
+		return sel.nb.x <= x2 && x1 <= sel.ne.x;
+	}
+
+	return (y != sel.nb.y || sel.nb.x <= x2) &&
+	       (y != sel.ne.y || x1 <= sel.ne.x);
+}
+
 void
 selsnap(int *x, int *y, int direction)
 {
 	int newx, newy, xt, yt;
 	int delim, prevdelim;
+	int top = IS_SET(MODE_ALTSCREEN) ? 0 : -term.histn - hist.n;
 	Glyph *gp, *prevgp;
 
 	switch (sel.snap) {
@@ -946,7 +2042,7 @@ selsnap(int *x, int *y, int direction)
 		 * Snap around if the word wraps around at the end or
 		 * beginning of a line.
 		 */
-		prevgp = &term.line[*y][*x];
+		prevgp = &tline(*y)[*x];
 		prevdelim = ISDELIM(prevgp->u);
 		for (;;) {
 			newx = *x + direction;
@@ -954,7 +2050,7 @@ selsnap(int *x, int *y, int direction)
 			if (!BETWEEN(newx, 0, term.col - 1)) {
 				newy += direction;
 				newx = (newx + term.col) % term.col;
-				if (!BETWEEN(newy, 0, term.row - 1)) {
+				if (!BETWEEN(newy, top, term.row - 1)) {
 					break;
 				}
 
@@ -963,7 +2059,7 @@ selsnap(int *x, int *y, int direction)
 				} else {
 					yt = newy, xt = newx;
 				}
-				if (!(term.line[yt][xt].mode & ATTR_WRAP)) {
+				if (!(ATTRMODE(tline(yt)[xt]) & ATTR_WRAP)) {
 					break;
 				}
 			}
@@ -972,9 +2068,9 @@ selsnap(int *x, int *y, int direction)
 				break;
 			}
 
-			gp = &term.line[newy][newx];
+			gp = &tline(newy)[newx];
 			delim = ISDELIM(gp->u);
-			if (!(gp->mode & ATTR_WDUMMY) &&
+			if (!(ATTRMODE(*gp) & ATTR_WDUMMY) &&
 			    (delim != prevdelim ||
 			     (delim && gp->u != prevgp->u))) {
 				break;
@@ -994,15 +2090,15 @@ selsnap(int *x, int *y, int direction)
 		 */
 		*x = (direction < 0) ? 0 : term.col - 1;
 		if (direction < 0) {
-			for (; *y > 0; *y += direction) {
-				if (!(term.line[*y - 1][term.col - 1].mode &
+			for (; *y > top; *y += direction) {
+				if (!(ATTRMODE(tline(*y - 1)[term.col - 1]) &
 				      ATTR_WRAP)) {
 					break;
 				}
 			}
 		} else if (direction > 0) {
 			for (; *y < term.row - 1; *y += direction) {
-				if (!(term.line[*y][term.col - 1].mode &
+				if (!(ATTRMODE(tline(*y)[term.col - 1]) &
 				      ATTR_WRAP)) {
 					break;
 				}
@@ -1012,6 +2108,7 @@ selsnap(int *x, int *y, int direction)
 	}
 }
 
+#ifndef HEADLESS
 void
 getbuttoninfo(const XEvent *e)
 {
@@ -1020,7 +2117,7 @@ getbuttoninfo(const XEvent *e)
 	sel.alt = IS_SET(MODE_ALTSCREEN);
 
 	sel.oe.x = x2col(e->xbutton.x);
-	sel.oe.y = y2row(e->xbutton.y);
+	sel.oe.y = y2row(e->xbutton.y) - term.scroll;
 	selnormalize();
 
 	sel.type = SEL_REGULAR;
@@ -1129,7 +2226,7 @@ bpress(XEvent *e)
 		sel.mode = SEL_EMPTY;
 		sel.type = SEL_REGULAR;
 		sel.oe.x = sel.ob.x = x2col(e->xbutton.x);
-		sel.oe.y = sel.ob.y = y2row(e->xbutton.y);
+		sel.oe.y = sel.ob.y = y2row(e->xbutton.y) - term.scroll;
 
 		/*
 		 * If the user clicks below predefined timeouts specific
@@ -1152,46 +2249,33 @@ bpress(XEvent *e)
 		sel.tclick1 = now;
 	}
 }
+#endif
 
 char *
 getsel(void)
 {
-	char *str, *ptr;
-	int y, bufsize, lastx, linelen;
-	Glyph *gp, *last;
+	Sink sk = {0};
+	int y, x1, lastx, linelen, wrap;
 
 	if (sel.ob.x == -1) {
 		return NULL;
 	}
 
-	bufsize = (term.col + 1) * (sel.ne.y - sel.nb.y + 1) * max_utf8_bytes;
-	ptr = str = (char *)xmalloc(bufsize);
-
 	// append every set & selected glyph to the selection
 	for (y = sel.nb.y; y <= sel.ne.y; y++) {
 		if ((linelen = tlinelen(y)) == 0) {
-			*ptr++ = '\n';
+			sinkwrite(&sk, "\n", 1);
 			continue;
 		}
 
 		if (sel.type == SEL_RECTANGULAR) {
-			gp = &term.line[y][sel.nb.x];
+			x1 = sel.nb.x;
 			lastx = sel.ne.x;
 		} else {
-			gp = &term.line[y][sel.nb.y == y ? sel.nb.x : 0];
+			x1 = sel.nb.y == y ? sel.nb.x : 0;
 			lastx = (sel.ne.y == y) ? sel.ne.x : term.col - 1;
 		}
-		last = &term.line[y][MIN(lastx, linelen - 1)];
-		while (last >= gp && last->u == ' ') {
-			--last;
-		}
-
-		for (; gp <= last; ++gp) {
-			if (gp->mode & ATTR_WDUMMY) {
-				continue;
-			}
-			ptr += utf8encode(gp->u, ptr);
-		}
+		wrap = tserialize(&sk, y, x1, MIN(lastx, linelen - 1));
 
 		/*
 		 * Copy and pasting of line endings is inconsistent
@@ -1202,15 +2286,15 @@ getsel(void)
 		 * st.
 		 * FIXME: Fix the computer world.
 		 */
-		if ((y < sel.ne.y || lastx >= linelen) &&
-		    !(last->mode & ATTR_WRAP)) {
-			*ptr++ = '\n';
+		if ((y < sel.ne.y || lastx >= linelen) && !wrap) {
+			sinkwrite(&sk, "\n", 1);
 		}
 	}
-	*ptr = 0;
-	return str;
+	sinkwrite(&sk, "", 1);
+	return sk.buf;
 }
 
+#ifndef HEADLESS
 void
 selcopy(Time t)
 {
@@ -1319,6 +2403,7 @@ selnotify(XEvent *e)
 	 */
 	XDeleteProperty(xw.dpy, xw.win, (int)property);
 }
+#endif
 
 void
 selpaste(UNUSED int unused)
@@ -1358,6 +2443,7 @@ selclear(UNUSED XEvent *unused)
 	tsetdirt(sel.nb.y, sel.ne.y);
 }
 
+#ifndef HEADLESS
 void
 selrequest(XEvent *e)
 {
@@ -1420,6 +2506,8 @@ void
 xsetsel(char *str, Bool clipboard, Time t)
 {
 	Atom selection;
+
+	pthread_mutex_lock(&xlock);
 	free(sel.clipboard);
 	free(sel.primary);
 	if (clipboard) {
@@ -1436,6 +2524,7 @@ xsetsel(char *str, Bool clipboard, Time t)
 	if (XGetSelectionOwner(xw.dpy, selection) != xw.win) {
 		selclear(NULL);
 	}
+	pthread_mutex_unlock(&xlock);
 }
 
 void
@@ -1485,6 +2574,7 @@ bmotion(XEvent *e)
 		tsetdirt(MIN(sel.nb.y, oldsby), MAX(sel.ne.y, oldsey));
 	}
 }
+#endif
 
 NORETURN void
 die(const char *errstr, ...)
@@ -1497,6 +2587,7 @@ die(const char *errstr, ...)
 	exit(1);
 }
 
+#ifndef HEADLESS
 void
 execsh(void)
 {
@@ -1615,6 +2706,7 @@ ttynew(void)
 
 	if (opt_io) {
 		term.mode |= MODE_PRINT;
+		tspecialize();
 		iofd = (strcmp(opt_io, "-") == 0)
 		           ? 1
 		           : open(opt_io, O_WRONLY | O_CREAT, 0666);
@@ -1630,6 +2722,7 @@ ttynew(void)
 		}
 		dup2(cmdfd, 0);
 		stty();
+		ttynonblock();
 		return;
 	}
 
@@ -1658,80 +2751,205 @@ ttynew(void)
 	default:  // We're the parent process.
 		close(s);
 		cmdfd = m;
+		ttynonblock();
 		signal(SIGCHLD, sigchld_handler);
 		break;
 	}
 }
 
+void
+ttynonblock(void)
+{
+	int flags;
+
+	if ((flags = fcntl(cmdfd, F_GETFL)) < 0 ||
+	    fcntl(cmdfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		die("fcntl failed: %s\n", strerror(errno));
+	}
+}
+#endif
+
+/*
+ * Reads everything the tty has to offer, up to the limits set by
+ * ttydrainbytes and ttydraintimeout, so floods of output take few wakeups.
+ * The buffer doubles, up to ttybufmax, whenever a read fills it. Returns the
+ * number of bytes read.
+ *
+ * Replies of the parser may call it again through ttywrite() while buf is
+ * being parsed. Such a call leaves buf alone and only drains the tty into
+ * spill, which the outer one parses once twrite() returns.
+ */
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	char *ptr;
-	int charsize;  // size of utf8 char in bytes
-	Rune unicodep;
-	int ret;
+	static char *buf, *spill;
+	static size_t bufsize, buflen = 0, spillsize = 0, spilllen = 0;
+	static int parsing;
+	struct timespec start, now;
+	size_t total = 0;
+	ssize_t ret;
+	int full;
+
+	if (parsing) {
+		if (spillsize - spilllen < ttybufmin) {
+			spillsize = MAX(spillsize * 2, spilllen + ttybufmin);
+			spill = xrealloc(spill, spillsize);
+		}
+		ret = ttyreadsome(spill + spilllen, spillsize - spilllen);
+		spilllen += ret;
+		return ret;
+	}
+
+	if (buf == NULL) {
+		bufsize = ttybufmin;
+		buf = xmalloc(bufsize);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		// append read bytes to unprocessed bytes, spilled ones first
+		if (spilllen > 0) {
+			ret = MIN(spilllen, bufsize - buflen);
+			memcpy(buf + buflen, spill, ret);
+			spilllen -= ret;
+			memmove(spill, spill + ret, spilllen);
+		} else if ((ret = ttyreadsome(buf + buflen,
+		                              bufsize - buflen)) == 0) {
+			break;
+		}
+		total += ret;
+		buflen += ret;
+		full = buflen == bufsize;
+
+		// keep any uncomplete utf8 char for the next read
+		parsing = 1;
+		ret = twrite(buf, buflen);
+		parsing = 0;
+		buflen -= ret;
+		memmove(buf, buf + ret, buflen);
+
+		if (full && bufsize < ttybufmax) {
+			bufsize = MIN(bufsize * 2, ttybufmax);
+			buf = xrealloc(buf, bufsize);
+		}
+		// spilled bytes may never be followed by more to wake us up
+		if (spilllen > 0) {
+			continue;
+		}
+		if (total >= ttydrainbytes) {
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (TIMEDIFF(now, start) >= ttydraintimeout) {
+			break;
+		}
+	}
+
+	tprinterflush();
+	++ttystats.wakeups;
+	ttystats.bytes += total;
+	ttystats.maxbytes = MAX(ttystats.maxbytes, total);
+
+	return total;
+}
+
+/*
+ * Reads what the tty has at hand into buf, of size bytes. Returns the number
+ * of bytes read, 0 if there are none yet or the shell hung up.
+ */
+size_t
+ttyreadsome(char *buf, size_t size)
+{
+	ssize_t ret;
 
-	// append read bytes to unprocessed bytes
-	if ((ret = read(cmdfd, buf + buflen, LEN(buf) - buflen)) < 0) {
+	while ((ret = read(cmdfd, buf, size)) < 0) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		// the shell hung up, it is reaped in sigchld_handler()
+		if (errno == EIO) {
+			ttyclosed = 1;
+			return 0;
+		}
 		// The process is probably done.
-		// TODO(townba): Check errno.
 		die("Couldn't read from shell: %s\n", strerror(errno));
 	}
+	if (ret == 0) {
+		ttyclosed = 1;
+	}
+
+	return ret;
+}
 
-	buflen += ret;
-	ptr = buf;
+/*
+ * Decodes and writes bytes from the tty to the terminal. Returns the number
+ * of bytes used, which leaves out an incomplete UTF-8 sequence at the end.
+ */
+size_t
+twrite(const char *s, size_t len)
+{
+	static Rune runes[BUFSIZ];
+	const char *ptr = s;
+	size_t i, n, nbytes, nrunes;
+	int utf8;
 
 	for (;;) {
-		if (IS_SET(MODE_UTF8)) {
-			if (buflen == 0) {
-				break;
+		if (term.nattr > term.attrmax) {
+			tattrgc();
+		}
+
+		// decode as much as possible in one go
+		utf8 = IS_SET(MODE_UTF8);
+		nrunes = LEN(runes);
+		if (utf8) {
+			nbytes = utf8decodestr(ptr, len, runes, &nrunes);
+		} else {
+			nrunes = nbytes = MIN(len, nrunes);
+			for (i = 0; i < nrunes; ++i) {
+				runes[i] = (uchar)ptr[i];
 			}
-			if ((c1utf8_as & C1UTF8_AS_BYTE) &&
-			    ISCONTROLC1((uchar)(ptr[0]))) {
-				// We aren't able to decode as UTF-8 because
-				// it's actually a control code.
-				unicodep = ptr[0] & 0xFF;
-				charsize = 1;
-			} else {
-				// process a complete utf8 char
-				charsize = utf8decode(ptr, buflen, &unicodep);
-				if (charsize == 0) {
-					break;
-				}
-				if (!(c1utf8_as & C1UTF8_AS_UTF8) &&
-				    ISCONTROLC1(unicodep)) {
-					// We don't accept C1 controls in UTF-8
-					// form.
-					unicodep = replacement_rune;
-				}
+		}
+		if (nrunes == 0) {
+			break;
+		}
+
+		for (i = 0; i < nrunes && IS_SET(MODE_UTF8) == utf8; i += n) {
+			// runs of printable ASCII are written at once
+			if ((n = tputascii(&runes[i], nrunes - i)) == 0) {
+				tputc(runes[i]);
+				n = 1;
 			}
-			tputc(unicodep);
-			ptr += charsize;
-			buflen -= charsize;
-		} else {
-			if (buflen <= 0) {
-				break;
+		}
+		ttystats.runes += i;
+		if (i < nrunes) {
+			/*
+			 * The UTF-8 mode changed halfway through, so the rest
+			 * has to be decoded again. Find out how many bytes the
+			 * runes already processed came from.
+			 */
+			nbytes = n = i;
+			if (utf8) {
+				nbytes =
+				    utf8decodestr_scalar(ptr, len, runes, &n);
 			}
-			tputc(*ptr++ & 0xFF);
-			buflen--;
 		}
-	}
-	// keep any uncomplete utf8 char for the next call
-	if (buflen > 0) {
-		memmove(buf, ptr, buflen);
+		ptr += nbytes;
+		len -= nbytes;
 	}
 
-	return ret;
+	return ptr - s;
 }
 
+#ifndef HEADLESS
 void
 ttywrite(const char *s, size_t n)
 {
 	fd_set wfd, rfd;
 	ssize_t r;
-	size_t lim = 256;
+	size_t lim = 256, nread;
 
 	/*
 	 * Remember that we are using a pty, which might be a modem line.
@@ -1759,7 +2977,10 @@ ttywrite(const char *s, size_t n)
 			 * for a serial line. Bigger values might clog the I/O.
 			 */
 			if ((r = write(cmdfd, s, (n < lim) ? n : lim)) < 0) {
-				goto write_error;
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					goto write_error;
+				}
+				r = 0;
 			}
 			if ((size_t)(r) < n) {
 				/*
@@ -1767,8 +2988,8 @@ ttywrite(const char *s, size_t n)
 				 * This means the buffer is getting full
 				 * again. Empty it.
 				 */
-				if (n < lim) {
-					lim = ttyread();
+				if (n < lim && (nread = ttyread()) > 0) {
+					lim = nread;
 				}
 				n -= r;
 				s += r;
@@ -1777,8 +2998,8 @@ ttywrite(const char *s, size_t n)
 				break;
 			}
 		}
-		if (FD_ISSET(cmdfd, &rfd)) {
-			lim = ttyread();
+		if (FD_ISSET(cmdfd, &rfd) && (nread = ttyread()) > 0) {
+			lim = nread;
 		}
 	}
 	return;
@@ -1786,6 +3007,7 @@ ttywrite(const char *s, size_t n)
 write_error:
 	die("write error on tty: %s\n", strerror(errno));
 }
+#endif
 
 void
 ttysend(const char *s, size_t n)
@@ -1794,6 +3016,10 @@ ttysend(const char *s, size_t n)
 	const char *t, *lim;
 	Rune u;
 
+	if (term.scroll > 0) {
+		term.scroll = 0;
+		tfulldirt();
+	}
 	ttywrite(s, n);
 	if (!IS_SET(MODE_ECHO)) {
 		return;
@@ -1830,161 +3056,1181 @@ ttyresize(void)
 	}
 }
 
-int
-tattrset(int attr)
+/*
+ * The attributes of glyphs are interned in term.attrs, so that a glyph is a
+ * rune and an index, and glyphs with the same attributes have the same index.
+ * The table grows as needed, and tattrgc() drops what it no longer uses.
+ */
+void
+tattrinit(void)
 {
-	int i, j;
+	term.attrsize = term.attrmax = 256;
+	term.attrs = (Attr *)xmalloc(term.attrsize * sizeof(*term.attrs));
+	term.attrs[ATTRID_BLANK] = (Attr){0, defaultfg, defaultbg};
+	term.nattr = 1;
+	term.attrhash = NULL;
+	tattrrehash();
+}
 
-	for (i = 0; i < term.row - 1; i++) {
-		for (j = 0; j < term.col - 1; j++) {
-			if (term.line[i][j].mode & attr) {
-				return 1;
-			}
+// Returns the index of the attributes in term.attrs, adding them if needed.
+uint32_t
+tattrid(const Attr *a)
+{
+	uint32_t i;
+
+	for (i = 0; i < LEN(term.attrmemo); i++) {
+		if (ATTREQ(term.attrs[term.attrmemo[i]], *a)) {
+			return term.attrmemo[i];
 		}
 	}
 
-	return 0;
+	return tattrintern(a);
 }
 
-void
-tsetdirt(int top, int bot)
+// Looks the attributes up in the hash table of term.attrs, or adds them.
+uint32_t
+tattrintern(const Attr *a)
 {
-	int i;
+	uint32_t h, i, mask = 2 * term.attrsize - 1;
 
-	LIMIT(top, 0, term.row - 1);
-	LIMIT(bot, 0, term.row - 1);
+	for (h = tattrhash(a); (i = term.attrhash[h & mask]); h++) {
+		if (ATTREQ(term.attrs[i - 1], *a)) {
+			break;
+		}
+	}
+	if (!i) {
+		if (term.nattr == term.attrsize) {
+			term.attrsize *= 2;
+			term.attrs = (Attr *)xrealloc(
+			    term.attrs, term.attrsize * sizeof(*term.attrs));
+			term.attrs[term.nattr++] = *a;
+			tattrrehash();
+		} else {
+			term.attrs[term.nattr++] = *a;
+			term.attrhash[h & mask] = term.nattr;
+		}
+		i = term.nattr;
+	}
 
-	for (i = top; i <= bot; i++) {
-		term.dirty[i] = 1;
+	memmove(term.attrmemo + 1, term.attrmemo,
+	        sizeof(term.attrmemo) - sizeof(*term.attrmemo));
+	term.attrmemo[0] = i - 1;
+	return i - 1;
+}
+
+// Returns the index of the attributes id with the flags cleared and set.
+uint32_t
+tattrmod(uint32_t id, ushort set, ushort clear)
+{
+	Attr a = term.attrs[id];
+
+	a.mode = (a.mode & ~clear) | set;
+	return tattrid(&a);
+}
+
+/*
+ * Drops the attributes no glyph uses any more and renumbers the others in
+ * every line. As the indices held by the callers of tattrid() would go stale,
+ * this only runs between two writes, once the table has doubled since the
+ * last time. The frames are published again, as they have the old numbers.
+ */
+void
+tattrgc(void)
+{
+	uint32_t *map, i, n;
+
+	map = (uint32_t *)xmalloc(term.nattr * sizeof(*map));
+	memset(map, 0, term.nattr * sizeof(*map));
+	map[ATTRID_BLANK] = 1;
+	tattrwalk(map, 0);
+	for (i = n = 0; i < term.nattr; i++) {
+		if (map[i]) {
+			term.attrs[n] = term.attrs[i];
+			map[i] = n++;
+		}
 	}
+	tattrwalk(map, 1);
+	free(map);
+
+	term.nattr = n;
+	term.attrmax = MAX(256, 2 * n);
+	tattrrehash();
+	memset(term.attrmemo, 0, sizeof(term.attrmemo));
+	term.attrgen++;
+	tfulldirt();
 }
 
+/*
+ * Marks the attributes of the glyphs of every line in map, or renumbers them
+ * with it. Lines not written yet may hold anything, which is left alone.
+ */
 void
-tsetdirtattr(int attr)
+tattrwalk(uint32_t *map, int renumber)
 {
-	int i, j;
+	int i, x, col;
+	Line line;
 
-	for (i = 0; i < term.row - 1; i++) {
-		for (j = 0; j < term.col - 1; j++) {
-			if (term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
+	for (i = 0; i < term.ringsize + term.row + HIST_CACHE; i++) {
+		col = term.col;
+		if (i < term.ringsize) {
+			line = term.ring[i];
+		} else if (i < term.ringsize + term.row) {
+			line = term.alt[i - term.ringsize];
+		} else {
+			line = hist.cache[i - term.ringsize - term.row];
+			col = hist.cachecol;
+		}
+		for (x = 0; line && x < col; x++) {
+			if (line[x].attr >= term.nattr) {
+				continue;
+			}
+			if (renumber) {
+				line[x].attr = map[line[x].attr];
+			} else {
+				map[line[x].attr] = 1;
 			}
 		}
 	}
 }
 
-void
-tfulldirt(void)
+uint32_t
+tattrhash(const Attr *a)
 {
-	tsetdirt(0, term.row - 1);
+	uint32_t h = a->mode * 0x9E3779B1u ^ a->fg * 0x85EBCA77u ^
+	             a->bg * 0xC2B2AE3Du;
+
+	return h ^ h >> 15;
 }
 
 void
-tcursor(enum cursor_movement mode)
+tattrrehash(void)
 {
-	static TCursor c[2];
-	int alt = IS_SET(MODE_ALTSCREEN);
+	uint32_t h, i, mask = 2 * term.attrsize - 1;
 
-	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
-	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+	term.attrhash = (uint32_t *)xrealloc(
+	    term.attrhash, 2 * term.attrsize * sizeof(*term.attrhash));
+	memset(term.attrhash, 0, 2 * term.attrsize * sizeof(*term.attrhash));
+	for (i = 0; i < term.nattr; i++) {
+		for (h = tattrhash(&term.attrs[i]); term.attrhash[h & mask];
+		     h++) {
+		}
+		term.attrhash[h & mask] = i + 1;
 	}
 }
 
-void
-treset(void)
+/*
+ * Returns where the modes of the glyphs of screen line y are summed up. They
+ * are kept by row of the arena, so that they move with the lines, and may
+ * have bits no glyph has any more: tattrline() drops those.
+ */
+ushort *
+tlinemode(int y)
 {
-	uint i;
+	return &term.linemode[(term.line[y] - term.arena) / term.stride];
+}
 
-	term.c =
-	    (TCursor){{.mode = ATTR_NULL, .fg = defaultfg, .bg = defaultbg},
-	              .x = 0,
-	              .y = 0,
-	              .state = CURSOR_DEFAULT};
+#ifndef HEADLESS
+// Returns whether a glyph of screen line y has one of the modes attr.
+int
+tattrline(int y, int attr)
+{
+	ushort *mode = tlinemode(y), m = 0;
+	int x;
 
-	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
-	for (i = tabspaces; i < term.col; i += tabspaces) {
-		term.tabs[i] = 1;
+	if (!(*mode & attr)) {
+		return 0;
 	}
-	term.top = 0;
-	term.bot = term.row - 1;
-	term.mode = MODE_WRAP | MODE_UTF8;
-	assert(LEN(term.trantbl) == 4);
-	term.trantbl[0] = CS_US_ASCII;
-	term.trantbl[1] = CS_US_ASCII;
-	term.trantbl[2] = CS_SPECIAL_GRAPHIC;
-	term.trantbl[3] = CS_SPECIAL_GRAPHIC;
-	term.charset = 0;
-
-	for (i = 0; i < 2; i++) {
-		tmoveto(0, 0);
-		tcursor(CURSOR_SAVE);
-		tclearregion(0, 0, term.col - 1, term.row - 1);
-		tswapscreen();
+	for (x = 0; x < term.col; x++) {
+		m |= ATTRMODE(term.line[y][x]);
 	}
+	*mode = m;
+	return (m & attr) != 0;
 }
 
-void
-tnew(int col, int row)
+int
+tattrset(int attr)
 {
-	term = (Term){.c = {.attr = {.fg = defaultfg, .bg = defaultbg}}};
-	tresize(col, row);
+	int y;
 
-	treset();
+	for (y = 0; y < term.row; y++) {
+		if (tattrline(y, attr)) {
+			return 1;
+		}
+	}
+
+	return 0;
 }
+#endif
 
+/*
+ * Marks dirty the columns x0 to x1 - 1 of line y. Until tpublish() gives the
+ * line a new generation, the columns marked add up in term.damage.
+ */
 void
-tswapscreen(void)
+tdamage(int y, int x0, int x1)
 {
-	Line *tmp = term.line;
+	Damage *d = &term.damage[y];
 
-	term.line = term.alt;
-	term.alt = tmp;
-	term.mode ^= MODE_ALTSCREEN;
-	tfulldirt();
+	if (!term.dirty[y]) {
+		term.dirty[y] = 1;
+		d->x0 = x0;
+		d->x1 = x1;
+	} else {
+		d->x0 = MIN(d->x0, x0);
+		d->x1 = MAX(d->x1, x1);
+	}
 }
 
 void
-tscrolldown(int orig, int n)
+tsetdirt(int top, int bot)
 {
 	int i;
-	Line temp;
-
-	LIMIT(n, 0, term.bot - orig + 1);
 
-	tsetdirt(orig, term.bot - n);
-	tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+	LIMIT(top, 0, term.row - 1);
+	LIMIT(bot, 0, term.row - 1);
 
-	for (i = term.bot; i >= orig + n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i - n];
-		term.line[i - n] = temp;
+	for (i = top; i <= bot; i++) {
+		tdamage(i, 0, term.col);
 	}
+}
+
+#ifndef HEADLESS
+void
+tsetdirtattr(int attr)
+{
+	int y;
+
+	for (y = 0; y < term.row; y++) {
+		if (tattrline(y, attr)) {
+			tsetdirt(y, y);
+		}
+	}
+}
+#endif
+
+void
+tfulldirt(void)
+{
+	tsetdirt(0, term.row - 1);
+}
+
+#ifndef HEADLESS
+/*
+ * Copies the lines changed since the last call into the back frame and swaps
+ * it with the middle one for draw(). A changed line gets a new generation,
+ * which tells both this and draw() what is out of date, and keeps in
+ * term.damage the columns changed since the generation it had, which are all
+ * draw() has to redraw of it when it drew that one. Nothing is published
+ * during a synchronized update, until it ends or lasts synctimeout. Returns
+ * whether a frame was published. Called with termlock held.
+ */
+int
+tpublish(void)
+{
+	static ulong count;
+	static int blink;
+	Frame *f = &frames[frameback];
+	int x, y, changed = 0;
+	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+	struct timespec now;
+
+	if (IS_SET(MODE_SYNC)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (TIMEDIFF(now, term.syncstart) < synctimeout) {
+			return 0;
+		}
+		MODBIT(term.mode, 0, MODE_SYNC);
+	}
+
+	// the view scrolled back shows every change one line lower
+	if (term.scroll > 0) {
+		for (y = 0; y < term.row && !term.dirty[y]; y++) {
+		}
+		if (y < term.row) {
+			tfulldirt();
+		}
+	}
+	for (y = 0; y < term.row; y++) {
+		if (term.dirty[y]) {
+			term.dirty[y] = 0;
+			term.damage[y].gen = term.gen[y];
+			term.gen[y] = ++count;
+		}
+	}
+
+	if (f->row != term.row || f->col != term.col) {
+		f->row = term.row;
+		f->col = term.col;
+		f->line = (Line *)xrealloc(f->line, f->row * sizeof(Line));
+		f->buf = (Glyph *)xrealloc(f->buf,
+		                           f->row * f->col * sizeof(Glyph));
+		f->gen = (ulong *)xrealloc(f->gen, f->row * sizeof(*f->gen));
+		f->damage = (Damage *)xrealloc(f->damage,
+		                               f->row * sizeof(*f->damage));
+		for (y = 0; y < f->row; y++) {
+			f->line[y] = &f->buf[y * f->col];
+			f->gen[y] = 0;
+		}
+	}
+
+	for (y = 0; y < f->row; y++) {
+		if (f->gen[y] == term.gen[y]) {
+			continue;
+		}
+		f->gen[y] = term.gen[y];
+		f->damage[y] = term.damage[y];
+		changed = 1;
+		memcpy(f->line[y], tline(y - term.scroll),
+		       f->col * sizeof(Glyph));
+		if (!ena_sel) {
+			continue;
+		}
+		for (x = 0; x < f->col; x++) {
+			if (ATTRMODE(f->line[y][x]) != ATTR_WDUMMY &&
+			    selected(x, y - term.scroll)) {
+				f->line[y][x].attr |= FRAME_REVERSE;
+			}
+		}
+	}
+
+	/*
+	 * Attributes are only added to the table between two renumberings,
+	 * so the frame needs just the new ones unless it was renumbered.
+	 */
+	if (f->attrgen != term.attrgen) {
+		f->attrgen = term.attrgen;
+		f->nattr = 0;
+	}
+	if (f->attrsize < term.nattr) {
+		f->attrsize = term.attrsize;
+		f->attrs = (Attr *)xrealloc(f->attrs,
+		                            f->attrsize * sizeof(*f->attrs));
+	}
+	memcpy(f->attrs + f->nattr, term.attrs + f->nattr,
+	       (term.nattr - f->nattr) * sizeof(*f->attrs));
+	f->nattr = term.nattr;
+
+	if (changed && blinktimeout) {
+		blink = tattrset(ATTR_BLINK);
+		if (!blink) {
+			MODBIT(term.mode, 0, MODE_BLINK);
+		}
+	}
+	f->blink = blink;
+	f->c = term.c;
+	f->mode = term.mode;
+	f->cursor = xw.cursor;
+	f->cursel = ena_sel && selected(term.c.x, term.c.y);
+	f->c.y += term.scroll;
+	if (f->c.y >= f->row) {
+		f->c.y = f->row - 1;
+		f->mode |= MODE_HIDE;
+	}
+
+	frameback = __atomic_exchange_n(&framemid, frameback | FRAME_NEW,
+	                                __ATOMIC_ACQ_REL) &
+	            ~FRAME_NEW;
+	return 1;
+}
+
+/*
+ * Reads and parses the output of the shell, publishing a frame after each
+ * read and telling the main thread through framefd, and compresses the
+ * history left over once there is nothing to read. Stops when the shell
+ * hangs up; the main thread exits when it is reaped.
+ */
+void *
+ttythread(UNUSED void *unused)
+{
+	const struct timespec zero = {0, 0};
+	fd_set rfd;
+	sigset_t set;
+	int ready, published, pending = 0;
+
+	// leave SIGCHLD to the main thread, whose pselect() it interrupts
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (!ttyclosed) {
+		FD_ZERO(&rfd);
+		FD_SET(cmdfd, &rfd);
+		if ((ready = pselect(cmdfd + 1, &rfd, NULL, NULL,
+		                     pending ? &zero : NULL, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			die("select failed: %s\n", strerror(errno));
+		}
+
+		pthread_mutex_lock(&termlock);
+		if (ready == 0) {
+			thistidle();
+			pending = 0;
+			pthread_mutex_unlock(&termlock);
+			continue;
+		}
+		ttyread();
+		published = tpublish();
+		// history over histsize waits for the tty to be idle
+		pending = term.histn > (int)histsize;
+		pthread_mutex_unlock(&termlock);
+
+		if (published && write(framefd[1], "", 1) < 0 &&
+		    errno != EAGAIN) {
+			die("write to frame pipe failed: %s\n",
+			    strerror(errno));
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+void
+tcursor(enum cursor_movement mode)
+{
+	int alt = IS_SET(MODE_ALTSCREEN);
+
+	if (mode == CURSOR_SAVE) {
+		term.saved[alt] = term.c;
+	} else if (mode == CURSOR_LOAD) {
+		term.c = term.saved[alt];
+		tmoveto(term.saved[alt].x, term.saved[alt].y);
+	}
+}
+
+void
+treset(void)
+{
+	uint i;
+
+	term.c =
+	    (TCursor){{.mode = ATTR_NULL, .fg = defaultfg, .bg = defaultbg},
+	              .x = 0,
+	              .y = 0,
+	              .state = CURSOR_DEFAULT};
+
+	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+	for (i = tabspaces; i < term.col; i += tabspaces) {
+		term.tabs[i] = 1;
+	}
+	term.top = 0;
+	term.bot = term.row - 1;
+	term.mode = MODE_WRAP | MODE_UTF8;
+	assert(LEN(term.trantbl) == 4);
+	term.trantbl[0] = CS_US_ASCII;
+	term.trantbl[1] = CS_US_ASCII;
+	term.trantbl[2] = CS_SPECIAL_GRAPHIC;
+	term.trantbl[3] = CS_SPECIAL_GRAPHIC;
+	term.charset = 0;
+	thistclear();
+	tspecialize();
+
+	for (i = 0; i < 2; i++) {
+		tmoveto(0, 0);
+		tcursor(CURSOR_SAVE);
+		tclearregion(0, 0, term.col - 1, term.row - 1);
+		tswapscreen();
+	}
+}
+
+void
+tnew(int col, int row)
+{
+	term = (Term){.c = {.attr = {.fg = defaultfg, .bg = defaultbg}}};
+	parserinit();
+	tattrinit();
+	tresize(col, row);
+
+	treset();
+}
+
+void
+tswapscreen(void)
+{
+	term.mode ^= MODE_ALTSCREEN;
+	term.line = IS_SET(MODE_ALTSCREEN) ? term.alt
+	                                   : &term.ring[term.ringsize + term.start];
+	term.scroll = 0;
+	tfulldirt();
+}
+
+/*
+ * The ring holds the lines of the main screen and its history, ringsize of
+ * them, three times over: ring[i], ring[i + ringsize] and ring[i + 2 *
+ * ringsize] are the same line. term.line points to the top screen line in the
+ * middle copy, so that term.line[y] is a screen line for 0 <= y < term.row and
+ * a line of history for -term.histn <= y < 0, without any wrapping. After the
+ * screen lines from top to bot are changed through term.line, this copies
+ * them to the other two copies.
+ */
+void
+tsyncring(int top, int bot)
+{
+	int i, y, len, c;
+	Line *dst;
+
+	for (y = top; y <= bot; y += len) {
+		i = (term.start + y) % term.ringsize;
+		len = MIN(bot - y + 1, term.ringsize - i);
+		for (c = 0; c < 3; c++) {
+			dst = &term.ring[c * term.ringsize + i];
+			if (dst != &term.line[y]) {
+				memcpy(dst, &term.line[y], len * sizeof(Line));
+			}
+		}
+	}
+}
+
+/*
+ * Rotates the screen lines from top to bot up by n, or down for n < 0: line
+ * y moves to y - n, and the lines pushed out at one end come back at the
+ * other.
+ */
+void
+trotate(int top, int bot, int n)
+{
+	Line keep[16], *tmp;
+	int len = bot - top + 1, m = abs(n);
+
+	if (m == 0 || m >= len) {
+		return;
+	}
+	tmp = m <= (int)LEN(keep) ? keep : (Line *)xmalloc(m * sizeof(Line));
+
+	if (n > 0) {
+		memcpy(tmp, &term.line[top], m * sizeof(Line));
+		memmove(&term.line[top], &term.line[top + m],
+		        (len - m) * sizeof(Line));
+		memcpy(&term.line[bot - m + 1], tmp, m * sizeof(Line));
+	} else {
+		memcpy(tmp, &term.line[bot - m + 1], m * sizeof(Line));
+		memmove(&term.line[top + m], &term.line[top],
+		        (len - m) * sizeof(Line));
+		memcpy(&term.line[top], tmp, m * sizeof(Line));
+	}
+
+	if (tmp != keep) {
+		free(tmp);
+	}
+	if (!IS_SET(MODE_ALTSCREEN)) {
+		tsyncring(top, bot);
+	}
+}
+
+/*
+ * Marks dirty the screen lines from top to bot whose contents change when
+ * they get the line n below them, or -n above them for n < 0. The lines that
+ * come from outside are left to the caller, which clears them.
+ */
+void
+tscrolldirt(int top, int bot, int n)
+{
+	Damage *d;
+	int y;
+
+	for (y = MAX(top, top - n); y <= MIN(bot, bot - n); y++) {
+		d = &term.damage[y];
+		if (term.dirty[y] && d->x0 <= 0 && d->x1 >= term.col) {
+			continue;
+		}
+		if (memcmp(term.line[y], term.line[y + n],
+		           term.col * sizeof(Glyph))) {
+			tdamage(y, 0, term.col);
+		}
+	}
+}
+
+/*
+ * Scrolls down the lines from orig to the bottom margin. Only the lines that
+ * change are marked dirty, unless there is a selection, which moves with
+ * them and goes if it is on the lines cleared.
+ */
+void
+tscrolldown(int orig, int n)
+{
+	LIMIT(n, 0, term.bot - orig + 1);
+
+	if (sel.ob.x != -1) {
+		tsetdirt(orig, term.bot - n);
+		tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+		trotate(orig, term.bot, -n);
+	} else {
+		tscrolldirt(orig, term.bot, -n);
+		trotate(orig, term.bot, -n);
+		tclearregion(0, orig, term.col - 1, orig + n - 1);
+	}
+
+	selscroll(orig, n);
+}
+
+/*
+ * Scrolls up the lines from orig to the bottom margin, like tscrolldown().
+ * With copyhist, the lines scrolled off the whole main screen are kept in the
+ * history.
+ */
+void
+tscrollup(int orig, int n, int copyhist)
+{
+	LIMIT(n, 0, term.bot - orig + 1);
+
+	if (copyhist && orig == 0 && term.bot == term.row - 1 &&
+	    !IS_SET(MODE_ALTSCREEN)) {
+		thistpush(n);
+		return;
+	}
+
+	if (sel.ob.x != -1) {
+		tclearregion(0, orig, term.col - 1, orig + n - 1);
+		tsetdirt(orig + n, term.bot);
+		trotate(orig, term.bot, n);
+	} else {
+		tscrolldirt(orig, term.bot, n);
+		trotate(orig, term.bot, n);
+		tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+	}
+
+	selscroll(orig, -n);
+}
+
+/*
+ * Drops the history of the main screen, and the selection if it reaches into
+ * it, as its lines are gone.
+ */
+void
+thistclear(void)
+{
+	if (sel.ob.x != -1 && !sel.alt && MIN(sel.ob.y, sel.oe.y) < 0) {
+		selclear(NULL);
+	}
+	term.histn = 0;
+	hclear();
+}
+
+/*
+ * Scrolls the main screen up by n lines by moving its start in the ring,
+ * whatever its height: the top lines become history and spare lines come back
+ * cleared at the bottom. Once there are none left, the oldest HIST_BATCH lines
+ * of history are compressed at once to free theirs.
+ */
+void
+thistpush(int n)
+{
+	int i;
+
+	if (sel.ob.x != -1 && !sel.alt) {
+		tsetdirt(0, term.row - n - 1);
+	} else {
+		tscrolldirt(0, term.row - 1, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (term.histn == term.ringsize - term.row) {
+			thistcompress(HIST_BATCH);
+		}
+		term.histn++;
+		term.start = (term.start + 1) % term.ringsize;
+	}
+	term.line = &term.ring[term.ringsize + term.start];
+
+	// keep the view on the same lines while it is scrolled back
+	if (term.scroll > 0) {
+		term.scroll = MIN(term.scroll + n, term.histn + hist.n);
+	}
+
+	if (sel.ob.x != -1 && !sel.alt) {
+		sel.ob.y -= n;
+		sel.oe.y -= n;
+		sel.nb.y -= n;
+		sel.ne.y -= n;
+		if (sel.nb.y < -term.histn - hist.n) {
+			selclear(NULL);
+		}
+	}
+
+	tclearregion(0, term.row - n, term.col - 1, term.row - 1);
+}
+
+/*
+ * Compresses the n oldest lines of history in the ring with hpush(), which
+ * frees their rows. They stay in the history, unless histmax drops them.
+ */
+void
+thistcompress(int n)
+{
+	Line *mainline = &term.ring[term.ringsize + term.start];
+	int y;
+
+	for (y = -term.histn; y < n - term.histn; y++) {
+		hpush(mainline[y], term.col);
+	}
+	term.histn -= n;
+
+	if (term.scroll > term.histn + hist.n) {
+		term.scroll = term.histn + hist.n;
+		tfulldirt();
+	}
+	if (sel.ob.x != -1 && !sel.alt && sel.nb.y < -term.histn - hist.n) {
+		selclear(NULL);
+	}
+}
+
+/*
+ * Compresses the lines of history over histsize, which the ring keeps for
+ * bursts of output, once the tty is idle.
+ */
+void
+thistidle(void)
+{
+	if (term.histn > (int)histsize) {
+		thistcompress(term.histn - histsize);
+	}
+}
+
+/*
+ * Returns line y of the main screen, or of its history for y < 0. Lines older
+ * than the ring are decompressed into a small cache, and stay valid until
+ * HIST_CACHE other lines have been asked for.
+ */
+Line
+tline(int y)
+{
+	int i, lo, hi, mid, slot;
+	ulong seq;
+	const HistBlock *b;
+
+	if (y >= -term.histn) {
+		return term.line[y];
+	}
+
+	if (hist.cachecol != term.col) {
+		for (i = 0; i < HIST_CACHE; i++) {
+			hist.cache[i] = (Line)xrealloc(
+			    hist.cache[i], term.col * sizeof(Glyph));
+			hist.cachekey[i] = 0;
+		}
+		hist.cachecol = term.col;
+	}
+	seq = hist.first + hist.n + y + term.histn;
+	slot = seq % HIST_CACHE;
+	if (hist.cachekey[slot] == seq + 1) {
+		return hist.cache[slot];
+	}
+
+	for (lo = 0, hi = hist.nblk - 1; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if (hist.blk[mid].first <= seq) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	b = &hist.blk[lo];
+	hdecode(hdata(b) + b->offs[seq - b->first], hist.cache[slot]);
+	hist.cachekey[slot] = seq + 1;
+
+	return hist.cache[slot];
+}
+
+// Writes v in groups of 7 bits, low first, with the top bit set on all but
+// the last.
+uchar *
+hputv(uchar *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7) {
+		*p++ = v | 0x80;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+// Writes a run of n glyphs with the attributes a.
+uchar *
+hputrun(uchar *p, int n, const Attr *a)
+{
+	p = hputv(p, n);
+	p = hputv(p, a->mode);
+	p = hputv(p, a->fg);
+	return hputv(p, a->bg);
+}
+
+uint32_t
+hgetv(const uchar **p)
+{
+	uint32_t v = 0;
+	int shift = 0;
+
+	do {
+		v |= (uint32_t)(**p & 0x7F) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+
+	return v;
+}
+
+/*
+ * Returns the width of the n glyphs of line without the trailing default
+ * blanks, which are skipped 8 at a time first, as in tfill().
+ */
+int
+hlinelen(const Glyph *line, int n)
+{
+#if defined(X86_SIMD) && defined(__SSE2__)
+	const Glyph blank = {' ', ATTRID_BLANK};
+	const __m128i *v;
+	__m128i b, eq, ok;
+	long long bv;
+	int i;
+
+	if (sizeof(Glyph) == 8) {
+		memcpy(&bv, &blank, sizeof(bv));
+		b = _mm_set1_epi64x(bv);
+		for (; n >= 8; n -= 8) {
+			v = (const __m128i *)&line[n - 8];
+			ok = _mm_cmpeq_epi32(_mm_loadu_si128(&v[0]), b);
+			for (i = 1; i < 4; i++) {
+				eq = _mm_cmpeq_epi32(_mm_loadu_si128(&v[i]), b);
+				ok = _mm_and_si128(ok, eq);
+			}
+			if (_mm_movemask_epi8(ok) != 0xFFFF) {
+				break;
+			}
+		}
+	}
+#endif
+	while (n > 0 && line[n - 1].u == ' ' &&
+	       line[n - 1].attr == ATTRID_BLANK) {
+		n--;
+	}
+
+	return n;
+}
+
+/*
+ * Compresses a line that leaves the ring into the newest block of history. A
+ * line is its width without the trailing blanks, the rune of each glyph, and
+ * the runs of glyphs with the same attributes. Wide dummies are stored as
+ * rune 0 and join the run they are in.
+ */
+void
+hpush(const Glyph *line, int col)
+{
+	const Attr *attrs = term.attrs;
+	HistBlock *b;
+	Glyph g;
+	uint32_t key;
+	uchar *p, *q, *start, *runs;
+	int n = col, x, end, run;
+
+	if (histmax == 0) {
+		return;
+	}
+
+	if (!(ATTRMODE(line[col - 1]) & ATTR_WRAP)) {
+		n = hlinelen(line, col);
+	}
+
+	if (hist.nblk == 0 ||
+	    hist.blk[hist.nblk - 1].data.len >= HIST_BLOCK_SIZ) {
+		if (hist.nblk > 0) {
+			b = &hist.blk[hist.nblk - 1];
+			b->data.buf = (char *)xrealloc(b->data.buf, b->data.len);
+			b->data.size = b->data.len;
+		}
+		if (hist.nblk == hist.blksize) {
+			hist.blksize = MAX(16, 2 * hist.blksize);
+			hist.blk = (HistBlock *)xrealloc(
+			    hist.blk, hist.blksize * sizeof(*hist.blk));
+		}
+		hist.blk[hist.nblk++] =
+		    (HistBlock){.first = hist.first + hist.n};
+		hspill();
+	}
+	b = &hist.blk[hist.nblk - 1];
+
+	// the offsets grow in powers of two
+	if (!(b->n & (b->n - 1))) {
+		b->offs = (uint32_t *)xrealloc(
+		    b->offs, MAX(1, 2 * b->n) * sizeof(*b->offs));
+	}
+	b->offs[b->n++] = b->data.len;
+
+	/*
+	 * One pass writes the runes and, 3 bytes a rune further on, the runs
+	 * of up to 16 bytes each, which are then moved down after the runes.
+	 */
+	start = p = (uchar *)sinkreserve(&b->data, 5 + n * 19);
+	p = hputv(p, n);
+	runs = q = p + 3 * n;
+	for (x = 0, key = line[0].attr, run = 0; x < n; x = end) {
+		end = MIN(x + 8, n);
+#if defined(X86_SIMD) && defined(__SSE2__)
+		/*
+		 * Printable ASCII in the current run is written 8 glyphs at a
+		 * time, gathered as in tserialize(): the runes must lie in 1 to
+		 * 0x7E, which leaves out wide dummies too, and the attrs must
+		 * all be key.
+		 */
+		if (sizeof(Glyph) == 8 && offsetof(Glyph, u) == 0 &&
+		    end - x == 8) {
+			const __m128i *v = (const __m128i *)&line[x];
+			__m128i m0, m1, ulo, uhi, alo, ahi, k, lo, hi, ok;
+
+			// each load holds 2 glyphs, rune and attr
+			m0 = _mm_loadu_si128(&v[0]);
+			m1 = _mm_loadu_si128(&v[1]);
+			ulo = _mm_unpacklo_epi32(m0, m1);
+			m0 = _mm_unpackhi_epi32(m0, m1);
+			alo = _mm_unpackhi_epi32(ulo, m0);
+			ulo = _mm_unpacklo_epi32(ulo, m0);
+			m0 = _mm_loadu_si128(&v[2]);
+			m1 = _mm_loadu_si128(&v[3]);
+			uhi = _mm_unpacklo_epi32(m0, m1);
+			m0 = _mm_unpackhi_epi32(m0, m1);
+			ahi = _mm_unpackhi_epi32(uhi, m0);
+			uhi = _mm_unpacklo_epi32(uhi, m0);
+			k = _mm_set1_epi32(key);
+			ok = _mm_and_si128(_mm_cmpeq_epi32(alo, k),
+			                   _mm_cmpeq_epi32(ahi, k));
+			lo = _mm_setzero_si128();
+			hi = _mm_set1_epi32(0x7F);
+			ok = _mm_and_si128(ok, _mm_cmpgt_epi32(ulo, lo));
+			ok = _mm_and_si128(ok, _mm_cmplt_epi32(ulo, hi));
+			ok = _mm_and_si128(ok, _mm_cmpgt_epi32(uhi, lo));
+			ok = _mm_and_si128(ok, _mm_cmplt_epi32(uhi, hi));
+			if (_mm_movemask_epi8(ok) == 0xFFFF) {
+				_mm_storel_epi64(
+				    (__m128i *)p,
+				    _mm_add_epi8(_mm_packus_epi16(
+				                     _mm_packs_epi32(ulo, uhi),
+				                     _mm_setzero_si128()),
+				                 _mm_set1_epi8(1)));
+				p += 8;
+				continue;
+			}
+		}
+#endif
+		/*
+		 * The glyphs are copied as the stores could alias them. Only
+		 * wide dummies have rune 0, so that the others don't look their
+		 * attributes up.
+		 */
+		for (; x < end; x++) {
+			g = line[x];
+			if (g.u - 1 < 0x7E) {
+				*p++ = g.u + 1;
+			} else if (g.u == 0 &&
+			           attrs[g.attr].mode & ATTR_WDUMMY) {
+				*p++ = 0;
+				continue;
+			} else {
+				p = hputv(p, g.u + 1);
+			}
+			if (g.attr != key) {
+				q = hputrun(q, x - run, &attrs[key]);
+				key = g.attr;
+				run = x;
+			}
+		}
+	}
+	if (n > 0) {
+		q = hputrun(q, n - run, &attrs[key]);
+	}
+	memmove(p, runs, q - runs);
+	p += q - runs;
+	b->data.len += p - start;
+	hist.mem += p - start;
+	hist.n++;
+
+	while (hist.n > (int)histmax && hist.nblk > 1) {
+		hdrop();
+	}
+}
+
+// Decompresses a line written by hpush() to the width of the screen.
+void
+hdecode(const uchar *p, Line line)
+{
+	int n = hgetv(&p), x, end;
+	uint32_t id, dummy;
+	Attr key;
+	Rune u;
+
+	// dummies are marked in attr until their run is known
+	for (x = 0; x < n; x++) {
+		u = hgetv(&p);
+		if (x < term.col) {
+			line[x].u = u ? u - 1 : 0;
+			line[x].attr = !u;
+		}
+	}
+	for (x = 0; x < n; x = end) {
+		end = x + hgetv(&p);
+		key.mode = hgetv(&p);
+		key.fg = hgetv(&p);
+		key.bg = hgetv(&p);
+		id = tattrid(&key);
+		dummy = tattrmod(id, ATTR_WDUMMY, key.mode);
+		for (; x < end && x < term.col; x++) {
+			line[x].attr = line[x].attr ? dummy : id;
+		}
+	}
+	if (n < term.col) {
+		tfill(&line[n], (Glyph){' ', ATTRID_BLANK}, term.col - n);
+	}
+}
+
+// Drops the oldest block of history.
+void
+hdrop(void)
+{
+	HistBlock *b = &hist.blk[0];
+
+	if (b->data.buf) {
+		hist.mem -= b->data.len;
+	} else {
+		hist.fdead += b->data.len;
+		hist.nspilled--;
+	}
+	free(b->data.buf);
+	free(b->offs);
+	hist.first += b->n;
+	hist.n -= b->n;
+	memmove(b, b + 1, --hist.nblk * sizeof(*b));
 
-	selscroll(orig, n);
+	if (hist.fd != -1 && hist.fdead > hist.flen / 2) {
+		hcompact();
+	}
 }
 
 void
-tscrollup(int orig, int n)
+hclear(void)
 {
-	int i;
-	Line temp;
+	while (hist.nblk > 0) {
+		hdrop();
+	}
+}
 
-	LIMIT(n, 0, term.bot - orig + 1);
+/*
+ * Moves the oldest full blocks to the spill file while the history takes more
+ * than histmem bytes of memory, or drops them if there is no such file.
+ */
+void
+hspill(void)
+{
+	HistBlock *b;
+
+	while (hist.mem > histmem && hist.nspilled < hist.nblk - 1) {
+		b = &hist.blk[hist.nspilled];
+		if (histspill && !hist.nospill && hist.fd == -1) {
+			hist.fd = hspillopen();
+			hist.nospill = hist.fd == -1;
+		}
+		if (hist.fd == -1) {
+			hdrop();
+			continue;
+		}
+		if (xwrite(hist.fd, b->data.buf, b->data.len) < 0) {
+			fprintf(stderr, "Error writing the history: %s\n",
+			        strerror(errno));
+			hist.nospill = 1;
+			hdrop();
+			continue;
+		}
+		b->off = hist.flen;
+		hist.flen += b->data.len;
+		hist.mem -= b->data.len;
+		free(b->data.buf);
+		b->data.buf = NULL;
+		b->data.size = 0;
+		hist.nspilled++;
+	}
+}
 
-	tclearregion(0, orig, term.col - 1, orig + n - 1);
-	tsetdirt(orig + n, term.bot);
+// Opens an unlinked file for the history in $TMPDIR, or /tmp.
+int
+hspillopen(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	int fd;
 
-	for (i = orig; i <= term.bot - n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i + n];
-		term.line[i + n] = temp;
+	snprintf(path, sizeof(path), "%s/st-histXXXXXX", dir ? dir : "/tmp");
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "Error creating %s: %s\n", path,
+		        strerror(errno));
+		return -1;
 	}
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-	selscroll(orig, -n);
+	return fd;
+}
+
+/*
+ * Copies the spilled blocks that are left to a new spill file, once the
+ * dropped ones take most of the old one.
+ */
+void
+hcompact(void)
+{
+	int i, fd = -1;
+	off_t len = 0;
+
+	if (hist.nspilled > 0) {
+		if ((fd = hspillopen()) == -1) {
+			return;
+		}
+		for (i = 0; i < hist.nspilled; i++) {
+			if (xwrite(fd, (const char *)hdata(&hist.blk[i]),
+			           hist.blk[i].data.len) < 0) {
+				fprintf(stderr, "Error writing the history: %s\n",
+				        strerror(errno));
+				close(fd);
+				return;
+			}
+		}
+		for (i = 0; i < hist.nspilled; i++) {
+			hist.blk[i].off = len;
+			len += hist.blk[i].data.len;
+		}
+	}
+
+	if (hist.map) {
+		munmap((void *)hist.map, hist.maplen);
+	}
+	close(hist.fd);
+	hist.fd = fd;
+	hist.flen = len;
+	hist.fdead = 0;
+	hist.map = NULL;
+	hist.maplen = 0;
+}
+
+// Returns the lines of a block, mapping the spill file as it grows.
+const uchar *
+hdata(const HistBlock *b)
+{
+	void *map;
+
+	if (b->data.buf) {
+		return (const uchar *)b->data.buf;
+	}
+	if (hist.maplen < (size_t)hist.flen) {
+		if (hist.map) {
+			munmap((void *)hist.map, hist.maplen);
+		}
+		map = mmap(NULL, hist.flen, PROT_READ, MAP_SHARED, hist.fd, 0);
+		if (map == MAP_FAILED) {
+			die("mmap of the history failed: %s\n", strerror(errno));
+		}
+		hist.map = map;
+		hist.maplen = hist.flen;
+	}
+
+	return hist.map + b->off;
 }
 
 void
@@ -2027,46 +4273,13 @@ tnewline(int first_col)
 	int y = term.c.y;
 
 	if (y == term.bot) {
-		tscrollup(term.top, 1);
+		tscrollup(term.top, 1, 1);
 	} else {
 		y++;
 	}
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void
-csiparse(void)
-{
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	if (BETWEEN(*p, 0x3C, 0x3F)) {
-		csiescseq.interm = *p;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = 0;
-	while (p < csiescseq.buf + csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p) {
-			v = 0;
-		}
-		if (v == LONG_MAX || v == LONG_MIN) {
-			v = -1;
-		}
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ) {
-			break;
-		}
-		p++;
-	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf + csiescseq.len) ? *p : 0;
-}
-
 // for absolute user moves, when decom is set
 void
 tmoveato(int x, int y)
@@ -2092,89 +4305,70 @@ tmoveto(int x, int y)
 }
 
 void
-tsetchar(Rune u, const Glyph *attr, int x, int y)
-{
-	static struct {
-		enum charset charset;
-		const Rune table[96];
-	} charset_to_table[] = {
-	    {CS_SPECIAL_GRAPHIC,
-	     {0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      0,
-	      0,      0,      0,      0,      0,      0,      0,      ' ',
-	      0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0xB0,   0xB1,
-	      0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
-	      0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
-	      0x2502, 0x2264, 0x2265, 0x3C0,  0x2260, 0xA3,   0xB7,   0}},
-	    {CS_TECHNICAL,
-	     // NOTE: 0x2B to 0x2E had been 0x239B, 0x239D, 0x239E, and 0x23A0,
-	     // but the new code points look closer to the original. 0x44 had
-	     // been 0x0394, but 0x2206 makes more sense.
-	     {0,      0x23B7, 0x250C, 0x2500, 0x2320, 0x2321, 0x2502, 0x23A1,
-	      0x23A3, 0x23A4, 0x23A6, 0x23A7, 0x23A9, 0x23AB, 0x23AD, 0x23A8,
-	      0x23AC, '<',    '<',    0x2572, 0x2571, '-',    '-',    '>',
-	      0x2426, 0x2426, 0x2426, 0x2426, 0x2264, 0x2260, 0x2265, 0x222B,
-	      0x2234, 0x221D, 0x221E, 0xF7,   0x2206, 0x2207, 0x3A6,  0x393,
-	      0x223C, 0x2243, 0x398,  0xD7,   0x39B,  0x21D4, 0x21D2, 0x2261,
-	      0x3A0,  0x3A8,  0x2426, 0x3A3,  0x2426, 0x2426, 0x221A, 0x3A9,
-	      0x39E,  0x3A5,  0x2282, 0x2283, 0x2229, 0x222A, 0x2227, 0x2228,
-	      0xAC,   0x3B1,  0x3B2,  0x3C7,  0x3B4,  0x3B5,  0x3C6,  0x3B3,
-	      0x3B7,  0x3B9,  0x3B8,  0x3BA,  0x3BB,  0x2426, 0x3BD,  0x2202,
-	      0x3C0,  0x3C8,  0x3C1,  0x3C3,  0x3C4,  0x2426, 0x192,  0x3C9,
-	      0x3BE,  0x3C5,  0x3B6,  0x2190, 0x2191, 0x2192, 0x2193, 0}},
-	    {CS_CURSES,
-	     // These are similar to special_graphics but with previously
-	     // unchanged characters changed to either blanks or new characters,
-	     // particularly for use in curses.
-	     {0,      ' ',    ' ',    0x25A0, 0xA7,   ' ',    0x2603, ' ',
-	      ' ',    ' ',    ' ',    0x2192, 0x2190, 0x2191, 0x2193, ' ',
-	      0x2588, ' ',    ' ',    ' ',    ' ',    ' ',    ' ',    ' ',
-	      ' ',    ' ',    ' ',    ' ',    0x2591, ' ',    0x2593, ' ',
-	      ' ',    0x255D, 0x2557, 0x2554, 0x255A, 0x256C, 0x2560, 0x2563,
-	      0x2569, 0x2566, 0x251B, 0x2513, 0x250F, 0x2517, 0x254B, ' ',
-	      ' ',    0x2501, 0x2550, ' ',    0x2523, 0x252B, 0x253B, 0x2533,
-	      0x2503, 0x2551, ' ',    ' ',    ' ',    ' ',    ' ',    ' ',
-	      0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0xB0,   0xB1,
-	      0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
-	      0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
-	      0x2502, 0x2264, 0x2265, 0x3C0,  0x2260, 0xA3,   0xB7,   0}},
-	};
+tsetchar(Rune u, const Attr *attr, int x, int y)
+{
+	Glyph *gp = &term.line[y][x];
+	int x0 = x, x1 = x + 1;
 
-	const Rune *trantbl = NULL;
-	for (size_t i = 0; i < LEN(charset_to_table); ++i) {
-		if (term.trantbl[term.charset] == charset_to_table[i].charset) {
-			trantbl = charset_to_table[i].table;
-		}
-	}
 	if (trantbl && BETWEEN(u, ' ', 0x7F) && trantbl[u - ' ']) {
 		u = trantbl[u - ' '];
 	}
 
-	if (term.line[y][x].mode & ATTR_WIDE) {
+	if (ATTRMODE(gp[0]) & ATTR_WIDE) {
 		if (x + 1 < term.col) {
-			term.line[y][x + 1].u = ' ';
-			term.line[y][x + 1].mode &= ~ATTR_WDUMMY;
+			gp[1].u = ' ';
+			gp[1].attr = tattrmod(gp[1].attr, 0, ATTR_WDUMMY);
+			x1++;
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x - 1].u = ' ';
-		term.line[y][x - 1].mode &= ~ATTR_WIDE;
+	} else if ((ATTRMODE(gp[0]) & ATTR_WDUMMY) && x > 0) {
+		// A deleted character can leave a dummy in the first column,
+		// with no wide glyph before it to fix up.
+		gp[-1].u = ' ';
+		gp[-1].attr = tattrmod(gp[-1].attr, 0, ATTR_WIDE);
+		x0--;
 	}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	term.line[y][x].u = u;
+	tdamage(y, x0, x1);
+	*tlinemode(y) |= attr->mode;
+	*gp = (Glyph){u, tattrid(attr)};
+}
+
+/*
+ * Sets the n glyphs from gp to g. Glyphs are 8 bytes, so that a 16 bytes
+ * store sets 2 of them.
+ */
+void
+tfill(Glyph *gp, Glyph g, int n)
+{
+	int i = 0;
+#if defined(X86_SIMD) && defined(__SSE2__)
+	long long v;
+	__m128i p;
+
+	if (sizeof(Glyph) == 8) {
+		memcpy(&v, &g, sizeof(v));
+		p = _mm_set1_epi64x(v);
+		for (; i + 8 <= n; i += 8) {
+			_mm_storeu_si128((__m128i *)&gp[i], p);
+			_mm_storeu_si128((__m128i *)&gp[i + 2], p);
+			_mm_storeu_si128((__m128i *)&gp[i + 4], p);
+			_mm_storeu_si128((__m128i *)&gp[i + 6], p);
+		}
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_si128((__m128i *)&gp[i], p);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		gp[i] = g;
+	}
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int y, temp;
+	Glyph blank;
 
 	if (x1 > x2) {
 		temp = x1, x1 = x2, x2 = temp;
@@ -2188,18 +4382,14 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y1, 0, term.row - 1);
 	LIMIT(y2, 0, term.row - 1);
 
+	blank = (Glyph){' ', tattrid(&(Attr){0, term.c.attr.fg,
+	                                     term.c.attr.bg})};
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y)) {
-				selclear(NULL);
-			}
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
+		tdamage(y, x1, x2 + 1);
+		if (sel.ob.x != -1 && selectedspan(x1, x2, y)) {
+			selclear(NULL);
 		}
+		tfill(&term.line[y][x1], blank, x2 - x1 + 1);
 	}
 }
 
@@ -2217,6 +4407,7 @@ tdeletechar(int n)
 	line = term.line[term.c.y];
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tdamage(term.c.y, dst, src + size);
 	tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
 }
 
@@ -2234,6 +4425,7 @@ tinsertblank(int n)
 	line = term.line[term.c.y];
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tdamage(term.c.y, dst, dst + size);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -2249,29 +4441,44 @@ void
 tdeleteline(int n)
 {
 	if (BETWEEN(term.c.y, term.top, term.bot)) {
-		tscrollup(term.c.y, n);
+		tscrollup(term.c.y, n, 0);
 	}
 }
 
 int32_t
-tdefcolor(const int *attr, int *npar, int l)
+tdefcolor(const int *attr, int *npar, int l, int nsub)
 {
 	int32_t idx = -1;
 	uint r, g, b;
+	// arguments after the 38 or 48
+	int n = nsub > 0 ? nsub : l - *npar - 1;
+
+	if (n < 1) {
+		fprintf(stderr,
+		        "erresc(38): Incorrect number of parameters (%d)\n",
+		        *npar);
+		return idx;
+	}
 
 	switch (attr[*npar + 1]) {
 	case 2:  // direct color in RGB space
-		if (*npar + 4 >= l) {
+		if (n < 4) {
 			fprintf(
 			    stderr,
 			    "erresc(38): Incorrect number of parameters (%d)\n",
 			    *npar);
 			break;
 		}
+		// 38:2:<color space>:r:g:b, or 38:2:r:g:b and 38;2;r;g;b
+		if (nsub >= 5) {
+			++attr;
+		}
 		r = attr[*npar + 2];
 		g = attr[*npar + 3];
 		b = attr[*npar + 4];
-		*npar += 4;
+		if (nsub == 0) {
+			*npar += 4;
+		}
 		if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) ||
 		    !BETWEEN(b, 0, 255)) {
 			fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n", r,
@@ -2281,19 +4488,20 @@ tdefcolor(const int *attr, int *npar, int l)
 		}
 		break;
 	case 5:  // indexed color
-		if (*npar + 2 >= l) {
+		if (n < 2) {
 			fprintf(
 			    stderr,
 			    "erresc(38): Incorrect number of parameters (%d)\n",
 			    *npar);
 			break;
 		}
-		*npar += 2;
-		if (!BETWEEN(attr[*npar], 0, 255)) {
-			fprintf(stderr, "erresc: bad fgcolor %d\n",
-			        attr[*npar]);
-		} else {
-			idx = attr[*npar];
+		idx = attr[*npar + 2];
+		if (nsub == 0) {
+			*npar += 2;
+		}
+		if (!BETWEEN(idx, 0, 255)) {
+			fprintf(stderr, "erresc: bad fgcolor %d\n", idx);
+			idx = -1;
 		}
 		break;
 	case 0:  // implemented defined (only foreground)
@@ -2309,13 +4517,19 @@ tdefcolor(const int *attr, int *npar, int l)
 	return idx;
 }
 
+/*
+ * Sets the attributes of SGR. An attribute can be followed by sub-parameters,
+ * as in 4:3 or 38:2::r:g:b, which are skipped unless the attribute takes them.
+ */
 void
-tsetattr(int *attr, int l)
+tsetattr(const int *attr, const char *sub, int l)
 {
-	int i;
+	int i, n;
 	int32_t idx;
 
-	for (i = 0; i < l; i++) {
+	for (i = 0; i < l; i += 1 + n) {
+		for (n = 0; i + n + 1 < l && sub[i + n + 1]; ++n) {
+		}
 		switch (attr[i]) {
 		case 0:
 			term.c.attr.mode &=
@@ -2335,7 +4549,9 @@ tsetattr(int *attr, int l)
 			term.c.attr.mode |= ATTR_ITALIC;
 			break;
 		case 4:
-			term.c.attr.mode |= ATTR_UNDERLINE;
+			// 4:0 is no underline, the other styles are underlined
+			MODBIT(term.c.attr.mode, n == 0 || attr[i + 1] != 0,
+			       ATTR_UNDERLINE);
 			break;
 		case 5:  // slow blink
 		// FALLTHROUGH
@@ -2373,7 +4589,7 @@ tsetattr(int *attr, int l)
 			term.c.attr.mode &= ~ATTR_STRUCK;
 			break;
 		case 38:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0) {
+			if ((idx = tdefcolor(attr, &i, l, n)) >= 0) {
 				term.c.attr.fg = idx;
 			}
 			break;
@@ -2381,7 +4597,7 @@ tsetattr(int *attr, int l)
 			term.c.attr.fg = defaultfg;
 			break;
 		case 48:
-			if ((idx = tdefcolor(attr, &i, l)) >= 0) {
+			if ((idx = tdefcolor(attr, &i, l, n)) >= 0) {
 				term.c.attr.bg = idx;
 			}
 			break;
@@ -2426,14 +4642,14 @@ tsetscroll(int t, int b)
 }
 
 void
-tsetmode(char interm, int set, const int *args, int narg)
+tsetmode(char priv, int set, const int *args, int narg)
 {
 	const int *lim;
 	int mode;
 	int alt;
 
 	for (lim = args + narg; args < lim; ++args) {
-		switch (interm) {
+		switch (priv) {
 		case '?':
 			switch (*args) {
 			case 1:  // DECCKM -- Cursor key
@@ -2445,12 +4661,7 @@ tsetmode(char interm, int set, const int *args, int narg)
 				// considered the default setting (even when
 				// it's not really the default).
 				if (!set || IS_SET(MODE_ENABLE_COLUMN_CHANGE)) {
-					cresize((set ? 132 : 80) * xw.cw +
-					            2 * borderpx,
-					        0);
-					ttyresize();
-					XResizeWindow(xw.dpy, xw.win, xw.w,
-					              xw.h);
+					xsetcols(set ? 132 : 80);
 					if (IS_SET(MODE_CLEAR_ON_DECCOLM)) {
 						tclearregion(0, 0, term.col - 1,
 						             term.row - 1);
@@ -2553,6 +4764,13 @@ tsetmode(char interm, int set, const int *args, int narg)
 			case 2004:  // 2004: bracketed paste mode
 				MODBIT(term.mode, set, MODE_BRCKTPASTE);
 				break;
+			case 2026:  // 2026: synchronized update
+				if (set && !IS_SET(MODE_SYNC)) {
+					clock_gettime(CLOCK_MONOTONIC,
+					              &term.syncstart);
+				}
+				MODBIT(term.mode, set, MODE_SYNC);
+				break;
 			// Not implemented mouse modes. See comments there.
 			case 1001: /* mouse highlight mode; can hang the
 			              terminal by design when implemented. */
@@ -2603,287 +4821,432 @@ tsetmode(char interm, int set, const int *args, int narg)
 			break;
 		}
 	}
+	tspecialize();
+}
+
+void
+csihandle(void)
+{
+	int i = 0;
+
+	if (csiescseq.interm >= 0) {
+		i = csitable[csiescseq.priv ? csiescseq.priv - 0x3B : 0]
+		            [csiescseq.interm ? csiescseq.interm - 0x1F : 0]
+		            [csiescseq.final - 0x40];
+	}
+	if (i == 0 || (csiescseq.nsub > 0 && !csihandlers[i - 1].subparams) ||
+	    csihandlers[i - 1].func() != 0) {
+		fprintf(stderr, "erresc: unknown csi ");
+		csidump();
+	}
+}
+
+int
+csiich(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblank(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicuu(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y - csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicud(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y + csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csimc(void)
+{
+	switch (csiescseq.arg[0]) {
+	case 0:
+		tdump();
+		break;
+	case 1:
+		tdumplines(term.c.y, term.c.y);
+		break;
+	case 2:
+		tdumpsel();
+		break;
+	case 4:
+		term.mode &= ~MODE_PRINT;
+		tspecialize();
+		break;
+	case 5:
+		term.mode |= MODE_PRINT;
+		tspecialize();
+		break;
+	}
+	return 0;
+}
+
+int
+csida(void)
+{
+	if (csiescseq.arg[0] == 0) {
+		ttywrite(da1_response, LEN(da1_response) - 1);
+	}
+	return 0;
+}
+
+int
+csida2(void)
+{
+	if (csiescseq.arg[0] == 0) {
+		ttywrite(da2_response, sizeof(da2_response) - 1);
+	}
+	return 0;
+}
+
+int
+csicuf(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x + csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicub(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x - csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicnl(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y + csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicpl(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y - csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csitbc(void)
+{
+	switch (csiescseq.arg[0]) {
+	case 0:  // clear current tab stop
+		term.tabs[term.c.x] = 0;
+		return 0;
+	case 3:  // clear all the tabs
+		memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+		return 0;
+	}
+	return -1;
+}
+
+int
+csicha(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(csiescseq.arg[0] - 1, term.c.y);
+	return 0;
+}
+
+int
+csicup(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], 1);
+	tmoveato(csiescseq.arg[1] - 1, csiescseq.arg[0] - 1);
+	return 0;
+}
+
+int
+csicht(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csied(void)
+{
+	selclear(NULL);
+	switch (csiescseq.arg[0]) {
+	case 0:  // below
+		tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
+		if (term.c.y < term.row - 1) {
+			tclearregion(0, term.c.y + 1, term.col - 1,
+			             term.row - 1);
+		}
+		return 0;
+	case 1:  // above
+		if (term.c.y > 1) {
+			tclearregion(0, 0, term.col - 1, term.c.y - 1);
+		}
+		tclearregion(0, term.c.y, term.c.x, term.c.y);
+		return 0;
+	case 2:  // all
+		tclearregion(0, 0, term.col - 1, term.row - 1);
+		return 0;
+	case 3:  // saved lines
+		if (!IS_SET(MODE_ALTSCREEN)) {
+			thistclear();
+			term.scroll = 0;
+			tfulldirt();
+		}
+		return 0;
+	}
+	return -1;
+}
+
+int
+csiel(void)
+{
+	switch (csiescseq.arg[0]) {
+	case 0:  // right
+		tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
+		break;
+	case 1:  // left
+		tclearregion(0, term.c.y, term.c.x, term.c.y);
+		break;
+	case 2:  // all
+		tclearregion(0, term.c.y, term.col - 1, term.c.y);
+		break;
+	}
+	return 0;
+}
+
+int
+csisu(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrollup(term.top, csiescseq.arg[0], 0);
+	return 0;
+}
+
+int
+csisd(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrolldown(term.top, csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csiil(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblankline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csirm(void)
+{
+	tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csidl(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeleteline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csiech(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tclearregion(term.c.x, term.c.y, term.c.x + csiescseq.arg[0] - 1,
+	             term.c.y);
+	return 0;
+}
+
+int
+csidch(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeletechar(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicbt(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csivpa(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveato(term.c.x, csiescseq.arg[0] - 1);
+	return 0;
+}
+
+int
+csism(void)
+{
+	tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+	return 0;
 }
 
-void
-csihandle(void)
+int
+csisgr(void)
+{
+	tsetattr(csiescseq.arg, csiescseq.sub, csiescseq.narg);
+	return 0;
+}
+
+int
+csidsr(void)
 {
 	char buf[40];
 	int len;
 
-	switch (csiescseq.interm) {
-	case 0:
-	case '?':
-		switch (csiescseq.mode[0]) {
-		default:
-		unknown:
-			fprintf(stderr, "erresc: unknown csi ");
-			csidump();
-			break;
-		case '@':  // ICH -- Insert <n> blank char
-			DEFAULT(csiescseq.arg[0], 1);
-			tinsertblank(csiescseq.arg[0]);
-			break;
-		case 'A':  // CUU -- Cursor <n> Up
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(term.c.x, term.c.y - csiescseq.arg[0]);
-			break;
-		case 'B':  // CUD -- Cursor <n> Down
-		case 'e':  // VPR --Cursor <n> Down
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(term.c.x, term.c.y + csiescseq.arg[0]);
-			break;
-		case 'i':  // MC -- Media Copy
-			switch (csiescseq.arg[0]) {
-			case 0:
-				tdump();
-				break;
-			case 1:
-				tdumpline(term.c.y);
-				break;
-			case 2:
-				tdumpsel();
-				break;
-			case 4:
-				term.mode &= ~MODE_PRINT;
-				break;
-			case 5:
-				term.mode |= MODE_PRINT;
-				break;
-			}
-			break;
-		case 'c':  // DA -- Device Attributes
-			if (csiescseq.arg[0] == 0) {
-				ttywrite(da1_response, LEN(da1_response) - 1);
-			}
-			break;
-		case 'C':  // CUF -- Cursor <n> Forward
-		case 'a':  // HPR -- Cursor <n> Forward
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(term.c.x + csiescseq.arg[0], term.c.y);
-			break;
-		case 'D':  // CUB -- Cursor <n> Backward
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(term.c.x - csiescseq.arg[0], term.c.y);
-			break;
-		case 'E':  // CNL -- Cursor <n> Down and first col
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(0, term.c.y + csiescseq.arg[0]);
-			break;
-		case 'F':  // CPL -- Cursor <n> Up and first col
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(0, term.c.y - csiescseq.arg[0]);
-			break;
-		case 'g':  // TBC -- Tabulation clear
-			switch (csiescseq.arg[0]) {
-			case 0:  // clear current tab stop
-				term.tabs[term.c.x] = 0;
-				break;
-			case 3:  // clear all the tabs
-				memset(term.tabs, 0,
-				       term.col * sizeof(*term.tabs));
-				break;
-			default:
-				goto unknown;
-			}
-			break;
-		case 'G':  // CHA -- Move to <col>
-		case '`':  // HPA
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveto(csiescseq.arg[0] - 1, term.c.y);
-			break;
-		case 'H':  // CUP -- Move to <row> <col>
-		case 'f':  // HVP
-			DEFAULT(csiescseq.arg[0], 1);
-			DEFAULT(csiescseq.arg[1], 1);
-			tmoveato(csiescseq.arg[1] - 1, csiescseq.arg[0] - 1);
-			break;
-		case 'I':  // CHT -- Cursor Forward Tabulation <n> tab stops
-			DEFAULT(csiescseq.arg[0], 1);
-			tputtab(csiescseq.arg[0]);
-			break;
-		case 'J':  // ED -- Clear screen
-			selclear(NULL);
-			switch (csiescseq.arg[0]) {
-			case 0:  // below
-				tclearregion(term.c.x, term.c.y, term.col - 1,
-				             term.c.y);
-				if (term.c.y < term.row - 1) {
-					tclearregion(0, term.c.y + 1,
-					             term.col - 1,
-					             term.row - 1);
-				}
-				break;
-			case 1:  // above
-				if (term.c.y > 1) {
-					tclearregion(0, 0, term.col - 1,
-					             term.c.y - 1);
-				}
-				tclearregion(0, term.c.y, term.c.x, term.c.y);
-				break;
-			case 2:  // all
-				tclearregion(0, 0, term.col - 1, term.row - 1);
-				break;
-			default:
-				goto unknown;
-			}
-			break;
-		case 'K':  // EL -- Clear line
-			switch (csiescseq.arg[0]) {
-			case 0:  // right
-				tclearregion(term.c.x, term.c.y, term.col - 1,
-				             term.c.y);
-				break;
-			case 1:  // left
-				tclearregion(0, term.c.y, term.c.x, term.c.y);
-				break;
-			case 2:  // all
-				tclearregion(0, term.c.y, term.col - 1,
-				             term.c.y);
-				break;
-			}
-			break;
-		case 'S':  // SU -- Scroll <n> line up
-			DEFAULT(csiescseq.arg[0], 1);
-			tscrollup(term.top, csiescseq.arg[0]);
-			break;
-		case 'T':  // SD -- Scroll <n> line down
-			DEFAULT(csiescseq.arg[0], 1);
-			tscrolldown(term.top, csiescseq.arg[0]);
-			break;
-		case 'L':  // IL -- Insert <n> blank lines
-			DEFAULT(csiescseq.arg[0], 1);
-			tinsertblankline(csiescseq.arg[0]);
-			break;
-		case 'l':  // RM -- Reset Mode
-			tsetmode(csiescseq.interm, 0, csiescseq.arg,
-			         csiescseq.narg);
-			break;
-		case 'M':  // DL -- Delete <n> lines
-			DEFAULT(csiescseq.arg[0], 1);
-			tdeleteline(csiescseq.arg[0]);
-			break;
-		case 'X':  // ECH -- Erase <n> char
-			DEFAULT(csiescseq.arg[0], 1);
-			tclearregion(term.c.x, term.c.y,
-			             term.c.x + csiescseq.arg[0] - 1, term.c.y);
-			break;
-		case 'P':  // DCH -- Delete <n> char
-			DEFAULT(csiescseq.arg[0], 1);
-			tdeletechar(csiescseq.arg[0]);
-			break;
-		case 'Z':  // CBT -- Cursor Backward Tabulation <n> tab stops
-			DEFAULT(csiescseq.arg[0], 1);
-			tputtab(-csiescseq.arg[0]);
-			break;
-		case 'd':  // VPA -- Move to <row>
-			DEFAULT(csiescseq.arg[0], 1);
-			tmoveato(term.c.x, csiescseq.arg[0] - 1);
-			break;
-		case 'h':  // SM -- Set terminal mode
-			tsetmode(csiescseq.interm, 1, csiescseq.arg,
-			         csiescseq.narg);
-			break;
-		case 'm':  // SGR -- Terminal attribute (color)
-			tsetattr(csiescseq.arg, csiescseq.narg);
-			break;
-		case 'n':  // DSR - Device Status Report (cursor position)
-			if (csiescseq.arg[0] == 6) {
-				len = snprintf(buf, sizeof(buf), "\x1B[%i;%iR",
-				               term.c.y + 1, term.c.x + 1);
-				ttywrite(buf, len);
-			}
-			break;
-		case 'r':  // DECSTBM -- Set Scrolling Region
-			if (csiescseq.interm) {
-				goto unknown;
-			} else {
-				DEFAULT(csiescseq.arg[0], 1);
-				DEFAULT(csiescseq.arg[1], term.row);
-				tsetscroll(csiescseq.arg[0] - 1,
-				           csiescseq.arg[1] - 1);
-				tmoveato(0, 0);
-			}
-			break;
-		case 's':  // DECSC -- Save cursor position (ANSI.SYS)
-			tcursor(CURSOR_SAVE);
-			break;
-		case 'u':  // DECRC -- Restore cursor position (ANSI.SYS)
-			tcursor(CURSOR_LOAD);
-			break;
-		case ' ':
-			switch (csiescseq.mode[1]) {
-			case 'q':  // DECSCUSR -- Set Cursor Style
-				DEFAULT(csiescseq.arg[0], 1);
-				if (!BETWEEN(csiescseq.arg[0], 0, 7)) {
-					goto unknown;
-				}
-				xw.cursor = csiescseq.arg[0];
-				break;
-			default:
-				goto unknown;
-			}
-			break;
-		case '$':  // DECSCPP -- Select Columns Per Page
-			switch (csiescseq.mode[1]) {
-			case '|':
-				if (IS_SET(MODE_ENABLE_COLUMN_CHANGE)) {
-					DEFAULT(csiescseq.arg[0],
-					        (int)opt_cols);
-					cresize(csiescseq.arg[0] * xw.cw +
-					            2 * borderpx,
-					        0);
-					ttyresize();
-					XResizeWindow(xw.dpy, xw.win, xw.w,
-					              xw.h);
-				}
-				break;
-			case '~':  // DECSSDT -- Select Status Display (Line)
-			           // Type
-				switch (csiescseq.arg[0]) {
-				case 0:  // No status line
-				case 1:  // Indicator status line
-					xresettitle();
-					MODBIT(term.mode, 0,
-					       MODE_WRITABLE_STATUS_LINE);
-					break;
-				case 2:  // Host-writable status line
-					if (!IS_SET(
-					        MODE_WRITABLE_STATUS_LINE)) {
-						xsettitle("");
-						MODBIT(
-						    term.mode, 1,
-						    MODE_WRITABLE_STATUS_LINE);
-					}
-					break;
-				default:
-					goto unknown;
-				}
+	if (csiescseq.arg[0] == 6) {  // cursor position
+		len = snprintf(buf, sizeof(buf), "\x1B[%i;%iR", term.c.y + 1,
+		               term.c.x + 1);
+		ttywrite(buf, len);
+	}
+	return 0;
+}
 
-			default:
-				goto unknown;
-			}
+int
+csidecstbm(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], term.row);
+	tsetscroll(csiescseq.arg[0] - 1, csiescseq.arg[1] - 1);
+	tmoveato(0, 0);
+	return 0;
+}
+
+int
+csidecsc(void)
+{
+	tcursor(CURSOR_SAVE);
+	return 0;
+}
+
+int
+csidecrc(void)
+{
+	tcursor(CURSOR_LOAD);
+	return 0;
+}
+
+int
+csidecscusr(void)
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	if (!BETWEEN(csiescseq.arg[0], 0, 7)) {
+		return -1;
+	}
+	xw.cursor = csiescseq.arg[0];
+	return 0;
+}
+
+int
+csidecscpp(void)
+{
+	if (IS_SET(MODE_ENABLE_COLUMN_CHANGE)) {
+		DEFAULT(csiescseq.arg[0], (int)opt_cols);
+		xsetcols(csiescseq.arg[0]);
+	}
+	return 0;
+}
+
+// Reports whether a mode is set, as 1, reset, as 2, or unknown, as 0.
+int
+csidecrqm(void)
+{
+	// modes and the value of their bit in term.mode when they are set
+	static const struct {
+		char priv;
+		int mode;
+		uint bit;
+		int set;
+	} modes[] = {
+	    {0, 2, MODE_KBDLOCK, 1},
+	    {0, 4, MODE_INSERT, 1},
+	    {0, 12, MODE_ECHO, 0},
+	    {0, 20, MODE_CRLF, 1},
+	    {'?', 1, MODE_APPCURSOR, 1},
+	    {'?', 5, MODE_REVERSE, 1},
+	    {'?', 7, MODE_WRAP, 1},
+	    {'?', 9, MODE_MOUSEX10, 1},
+	    {'?', 25, MODE_HIDE, 0},
+	    {'?', 40, MODE_ENABLE_COLUMN_CHANGE, 1},
+	    {'?', 47, MODE_ALTSCREEN, 1},
+	    {'?', 66, MODE_APPKEYPAD, 1},
+	    {'?', 95, MODE_CLEAR_ON_DECCOLM, 0},
+	    {'?', 1000, MODE_MOUSEBTN, 1},
+	    {'?', 1002, MODE_MOUSEMOTION, 1},
+	    {'?', 1003, MODE_MOUSEMANY, 1},
+	    {'?', 1004, MODE_FOCUS, 1},
+	    {'?', 1006, MODE_MOUSESGR, 1},
+	    {'?', 1034, MODE_8BIT, 1},
+	    {'?', 1047, MODE_ALTSCREEN, 1},
+	    {'?', 1049, MODE_ALTSCREEN, 1},
+	    {'?', 2004, MODE_BRCKTPASTE, 1},
+	    {'?', 2026, MODE_SYNC, 1},
+	};
+	char buf[40];
+	int len, state = 0;
+
+	for (size_t i = 0; i < LEN(modes); i++) {
+		if (modes[i].priv == csiescseq.priv &&
+		    modes[i].mode == csiescseq.arg[0]) {
+			state = IS_SET(modes[i].bit) == modes[i].set ? 1 : 2;
 			break;
 		}
-		break;
-	case '>':
-		switch (csiescseq.mode[0]) {
-		case 'c':  // Send device attributes (secondary DA)
-			if (csiescseq.arg[0] == 0) {
-				ttywrite(da2_response,
-				         sizeof(da2_response) - 1);
-			}
-			break;
-		case 'm':  // Set/reset modify keys (IGNORED)
-		case 'n':  // Disable modify keys (IGNORED)
-			break;
-		default:
-			fprintf(stderr, "erresc: unknown csi ");
-			csidump();
-			break;
+	}
+	len = snprintf(buf, sizeof(buf), "\x1B[%s%d;%d$y",
+	               csiescseq.priv ? "?" : "", csiescseq.arg[0], state);
+	ttywrite(buf, len);
+	return 0;
+}
+
+int
+csidecssdt(void)
+{
+	switch (csiescseq.arg[0]) {
+	case 0:  // No status line
+	case 1:  // Indicator status line
+		xresettitle();
+		MODBIT(term.mode, 0, MODE_WRITABLE_STATUS_LINE);
+		return 0;
+	case 2:  // Host-writable status line
+		if (!IS_SET(MODE_WRITABLE_STATUS_LINE)) {
+			xsettitle("");
+			MODBIT(term.mode, 1, MODE_WRITABLE_STATUS_LINE);
 		}
-		break;
+		return 0;
 	}
+	return -1;
+}
+
+int
+csiignore(void)
+{
+	return 0;
 }
 
 void
@@ -2905,19 +5268,65 @@ chardump(char c)
 void
 csidump(void)
 {
-	size_t i;
+	int i;
 
 	fprintf(stderr, "\\e[");
-	for (i = 0; i < csiescseq.len; i++) {
-		chardump(csiescseq.buf[i] & 0xFF);
+	if (csiescseq.priv) {
+		putc(csiescseq.priv, stderr);
+	}
+	for (i = 0; i < csiescseq.narg; i++) {
+		if (i > 0) {
+			putc(csiescseq.sub[i] ? ':' : ';', stderr);
+		}
+		fprintf(stderr, "%d", csiescseq.arg[i]);
+	}
+	if (csiescseq.interm > 0) {
+		putc(csiescseq.interm, stderr);
 	}
+	chardump(csiescseq.final);
 	putc('\n', stderr);
 }
 
 void
 csireset(void)
 {
-	memset(&csiescseq, 0, sizeof(csiescseq));
+	// The other arguments are cleared when they start.
+	csiescseq.priv = csiescseq.final = 0;
+	csiescseq.interm = csiescseq.narg = csiescseq.nsub = 0;
+	csiescseq.arg[0] = csiescseq.arg[1] = 0;
+}
+
+void
+parserinit(void)
+{
+	const ParseRule *r;
+	const CSIHandler *h;
+	size_t i;
+	int s, c;
+
+	for (s = 0; s < PS_NUM; ++s) {
+		for (c = 0; c <= PARSE_OTHER; ++c) {
+			parsetable[s][c] = (Transition){PA_NONE, PS_STAY};
+		}
+	}
+	for (r = parserules; r < parserules + LEN(parserules); ++r) {
+		for (s = 0; s < PS_NUM; ++s) {
+			if (r->state != s && r->state != PS_ANYWHERE) {
+				continue;
+			}
+			for (c = r->first; c <= r->last; ++c) {
+				parsetable[s][c] =
+				    (Transition){r->action, r->next};
+			}
+		}
+	}
+
+	for (i = 0; i < LEN(csihandlers); ++i) {
+		h = &csihandlers[i];
+		csitable[h->priv ? h->priv - 0x3B : 0]
+		        [h->interm ? h->interm - 0x1F : 0][h->final - 0x40] =
+		            i + 1;
+	}
 }
 
 void
@@ -2928,7 +5337,11 @@ strhandle(void)
 	int j, narg, par;
 	size_t buflen;
 
-	term.esc &= ~(ESC_STR_END | ESC_STR);
+	// the rest of a streamed string goes the same way
+	if (strescseq.hdrlen > 0) {
+		strflush();
+	}
+
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -2970,7 +5383,7 @@ strhandle(void)
 			}
 			c = strescseq.args[1];
 			p = strescseq.args[2];
-			if (strcmp(p, "?") == 0) {
+			if (strescseq.hdrlen == 0 && strcmp(p, "?") == 0) {
 				/* Pasting from the clipboard as a result of
 				 * a control sequence is a security risk, so we
 				 * always use an empty string.
@@ -2983,8 +5396,8 @@ strhandle(void)
 				free(buf);
 				return;
 			}
-			if (base64decode(p, (uchar **)(&buf), &buflen) ==
-			    strlen(p)) {
+			if (strdecode64(p, strlen(p)) == 0) {
+				buf = strescseq.data ? strescseq.data : "";
 				for (*c || (c = defaultosc52); *c; c++) {
 					switch (*c) {
 					case 'c':
@@ -3001,7 +5414,6 @@ strhandle(void)
 					}
 				}
 			}
-			free(buf);
 			return;
 		}
 		break;
@@ -3015,10 +5427,10 @@ strhandle(void)
 			    "\x1BP65;1\"p\x1B\\";
 			ttywrite(decscl_response, LEN(decscl_response) - 1);
 		}
-		term.mode |= ESC_DCS;
 		return;
 	case '_':  // APC -- Application Program Command
 	case '^':  // PM -- Privacy Message
+	case 'X':  // SOS -- Start of String
 		return;
 	}
 
@@ -3072,7 +5484,84 @@ strdump(void)
 void
 strreset(void)
 {
-	memset(&strescseq, 0, sizeof(strescseq));
+	free(strescseq.data);
+	strescseq.type = 0;
+	strescseq.len = strescseq.narg = strescseq.hdrlen = 0;
+	strescseq.data = NULL;
+	strescseq.datalen = strescseq.datasize = 0;
+	strescseq.padded = strescseq.err = 0;
+}
+
+/*
+ * Makes room in the string buffer by handing what it holds to the command of
+ * the string, if the command can take it in parts. Only the selections of OSC
+ * 52 can so far: their base64 is decoded as it arrives. Returns nonzero if it
+ * made room.
+ */
+int
+strflush(void)
+{
+	char *p, *s;
+	size_t n;
+
+	if (strescseq.hdrlen == 0) {
+		// the head is "52;<selections>;"
+		if (strescseq.type != ']' || strescseq.len < 3 ||
+		    strncmp(strescseq.buf, "52;", 3) != 0 ||
+		    (p = memchr(strescseq.buf + 3, ';',
+		                strescseq.len - 3)) == NULL) {
+			return 0;
+		}
+		strescseq.hdrlen = p + 1 - strescseq.buf;
+	}
+
+	// keep incomplete groups of four for later
+	s = strescseq.buf + strescseq.hdrlen;
+	n = (strescseq.len - strescseq.hdrlen) & ~3;
+	strdecode64(s, n);
+	memmove(s, s + n, strescseq.len - strescseq.hdrlen - n);
+	strescseq.len -= n;
+	return n > 0;
+}
+
+/*
+ * Decodes len bytes of base64 of the string and appends them to its data, up
+ * to osc52max bytes. Returns nonzero if the base64 is invalid or too long.
+ */
+int
+strdecode64(const char *s, size_t len)
+{
+	size_t n, out;
+
+	if (strescseq.err) {
+		return 1;
+	}
+	if (!strescseq.padded) {
+		n = strescseq.datalen + len / 4 * 3 + 3;
+		if (n > osc52max) {
+			fprintf(stderr,
+			        "erresc: OSC 52 selection longer than %zu bytes\n",
+			        osc52max);
+			return strescseq.err = 1;
+		}
+		if (n > strescseq.datasize) {
+			strescseq.datasize = MIN(MAX(n, strescseq.datasize * 2),
+			                         osc52max);
+			strescseq.data =
+			    xrealloc(strescseq.data, strescseq.datasize);
+		}
+		n = base64decode(s, len, (uchar *)strescseq.data +
+		                                     strescseq.datalen,
+		                 &out);
+		strescseq.datalen += out;
+		strescseq.data[strescseq.datalen] = 0;
+		s += n;
+		len -= n;
+	}
+	for (; len > 0 && *s == '='; ++s, --len) {
+		strescseq.padded = 1;
+	}
+	return strescseq.err = len > 0;
 }
 
 void
@@ -3089,15 +5578,69 @@ reset(UNUSED int unused)
 	treset();
 }
 
+/*
+ * Scrolls the view of the main screen n lines back into the history, or n
+ * screens if n is negative. Input to the tty scrolls it back down.
+ */
+void
+kscrollup(int n)
+{
+	if (IS_SET(MODE_ALTSCREEN)) {
+		return;
+	}
+	if (n < 0) {
+		n = -n * term.row;
+	}
+	n = MIN(term.scroll + n, term.histn + hist.n);
+	if (n != term.scroll) {
+		term.scroll = n;
+		tfulldirt();
+	}
+}
+
+void
+kscrolldown(int n)
+{
+	if (n < 0) {
+		n = -n * term.row;
+	}
+	n = MAX(term.scroll - n, 0);
+	if (n != term.scroll) {
+		term.scroll = n;
+		tfulldirt();
+	}
+}
+
 void
 tprinter(const char *s, size_t len)
 {
-	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
-		fprintf(stderr, "Error writing in %s:%s\n", opt_io,
-		        strerror(errno));
+	size_t n;
+
+	while (len > 0 && iofd != -1) {
+		if (printbuf.len == sizeof(printbuf.buf)) {
+			tprinterflush();
+		}
+		n = MIN(len, sizeof(printbuf.buf) - printbuf.len);
+		memcpy(printbuf.buf + printbuf.len, s, n);
+		printbuf.len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+// Writes out the output buffered by tprinter().
+void
+tprinterflush(void)
+{
+	if (iofd != -1 && printbuf.len > 0 &&
+	    xwrite(iofd, printbuf.buf, printbuf.len) < 0) {
+		// without -o, iofd is the standard output, as with -o -
+		fprintf(stderr, "Error writing in %s:%s\n",
+		        opt_io ? opt_io : "-", strerror(errno));
 		close(iofd);
 		iofd = -1;
 	}
+	printbuf.len = 0;
 }
 
 void
@@ -3127,18 +5670,22 @@ void
 toggleprinter(UNUSED int unused)
 {
 	term.mode ^= MODE_PRINT;
+	tspecialize();
+	tprinterflush();
 }
 
 void
 printscreen(UNUSED int unused)
 {
 	tdump();
+	tprinterflush();
 }
 
 void
 printsel(UNUSED int unused)
 {
 	tdumpsel();
+	tprinterflush();
 }
 
 void
@@ -3152,30 +5699,119 @@ tdumpsel(void)
 	}
 }
 
+// Prints lines y1 to y2, each ended by a newline.
 void
-tdumpline(int n)
+tdumplines(int y1, int y2)
 {
-	char buf[max_utf8_bytes];
-	Glyph *bp, *end;
+	Sink sk = {0};
+	int y;
 
-	bp = &term.line[n][0];
-	end = &bp[MIN(tlinelen(n), term.col) - 1];
-	if (bp != end || bp->u != ' ') {
-		for (; bp <= end; ++bp) {
-			tprinter(buf, utf8encode(bp->u, buf));
-		}
+	for (y = y1; y <= y2; ++y) {
+		tserialize(&sk, y, 0, term.col - 1);
+		sinkwrite(&sk, "\n", 1);
 	}
-	tprinter("\n", 1);
+	tprinter(sk.buf, sk.len);
+	free(sk.buf);
 }
 
 void
 tdump(void)
 {
-	int i;
+	tdumplines(0, term.row - 1);
+}
+
+/*
+ * Appends columns x1 to x2 of line y to a sink as UTF-8. Trailing spaces are
+ * left out unless the line wraps into the next one at x2. Returns whether it
+ * does.
+ */
+int
+tserialize(Sink *sk, int y, int x1, int x2)
+{
+	const Glyph *gp = tline(y);
+	int x, end;
+	int wrap = x2 == term.col - 1 && (ATTRMODE(gp[x2]) & ATTR_WRAP);
+	char *p;
 
-	for (i = 0; i < term.row; ++i) {
-		tdumpline(i);
+	if (!wrap) {
+		while (x2 >= x1 && gp[x2].u == ' ') {
+			--x2;
+		}
+	}
+	if (x2 < x1) {
+		return wrap;
+	}
+
+	p = sinkreserve(sk, (x2 - x1 + 1) * max_utf8_bytes);
+	for (x = x1; x <= x2; x = end) {
+		end = MIN(x + 8, x2 + 1);
+#if defined(X86_SIMD) && defined(__SSE2__)
+		/*
+		 * Printable ASCII is narrowed 8 glyphs at a time: the runes,
+		 * the first 4 bytes of each glyph, are gathered and checked to
+		 * lie in ' ' to 0x7F, which leaves out wide dummies too.
+		 */
+		if (sizeof(Glyph) == 8 && offsetof(Glyph, u) == 0 &&
+		    end - x == 8) {
+			const __m128i *v = (const __m128i *)&gp[x];
+			__m128i a, b, lo, hi, ok;
+
+			// each load holds 2 glyphs, rune and attr
+			a = _mm_loadu_si128(&v[0]);
+			b = _mm_loadu_si128(&v[1]);
+			lo = _mm_unpacklo_epi32(_mm_unpacklo_epi32(a, b),
+			                        _mm_unpackhi_epi32(a, b));
+			a = _mm_loadu_si128(&v[2]);
+			b = _mm_loadu_si128(&v[3]);
+			hi = _mm_unpacklo_epi32(_mm_unpacklo_epi32(a, b),
+			                        _mm_unpackhi_epi32(a, b));
+			// runes are below 0x110000, so this can't overflow
+			ok = _mm_and_si128(
+			    _mm_cmpgt_epi32(lo, _mm_set1_epi32(' ' - 1)),
+			    _mm_cmplt_epi32(lo, _mm_set1_epi32(0x80)));
+			ok = _mm_and_si128(
+			    ok, _mm_and_si128(
+			            _mm_cmpgt_epi32(hi, _mm_set1_epi32(' ' - 1)),
+			            _mm_cmplt_epi32(hi, _mm_set1_epi32(0x80))));
+			if (_mm_movemask_epi8(ok) == 0xFFFF) {
+				_mm_storel_epi64(
+				    (__m128i *)p,
+				    _mm_packus_epi16(_mm_packs_epi32(lo, hi),
+				                     _mm_setzero_si128()));
+				p += 8;
+				continue;
+			}
+		}
+#endif
+		for (; x < end; ++x) {
+			if (BETWEEN(gp[x].u, ' ', 0x7F)) {
+				*p++ = gp[x].u;
+			} else if (!(ATTRMODE(gp[x]) & ATTR_WDUMMY)) {
+				p += utf8encode(gp[x].u, p);
+			}
+		}
+	}
+	sk->len = p - sk->buf;
+
+	return wrap;
+}
+
+// Makes room for n more bytes in a sink and returns where they go.
+char *
+sinkreserve(Sink *sk, size_t n)
+{
+	if (sk->size - sk->len < n) {
+		sk->size = MAX(sk->size * 2, sk->len + n);
+		sk->buf = (char *)xrealloc(sk->buf, sk->size);
 	}
+	return sk->buf + sk->len;
+}
+
+void
+sinkwrite(Sink *sk, const char *s, size_t n)
+{
+	memcpy(sinkreserve(sk, n), s, n);
+	sk->len += n;
 }
 
 void
@@ -3221,6 +5857,7 @@ tdefutf8(char ascii)
 	} else if (ascii == '@') {
 		term.mode &= ~MODE_UTF8;
 	}
+	tspecialize();
 }
 
 void
@@ -3235,6 +5872,7 @@ tdeftran(char ascii)
 		fprintf(stderr, "esc unhandled charset: ESC ( %c\n", ascii);
 	} else {
 		term.trantbl[term.icharset] = vcs[p - cs];
+		tspecialize();
 	}
 }
 
@@ -3260,7 +5898,9 @@ tstrsequence(uchar c)
 	switch (c) {
 	case 0x90:  // DCS -- Device Control String
 		c = 'P';
-		term.esc |= ESC_DCS;
+		break;
+	case 0x98:  // SOS -- Start of String
+		c = 'X';
 		break;
 	case 0x9F:  // APC -- Application Program Command
 		c = '_';
@@ -3273,7 +5913,6 @@ tstrsequence(uchar c)
 		break;
 	}
 	strescseq.type = c;
-	term.esc |= ESC_STR;
 }
 
 void
@@ -3293,35 +5932,21 @@ tcontrolcode(uchar ascii)
 	case '\v':  // VT
 	case '\n':  // LF
 		// go to first col if the mode is set
-		tnewline(IS_SET(MODE_CRLF));
-		return;
-	case '\a':  // BEL
-		if (term.esc & ESC_STR_END) {
-			// backwards compatibility to xterm
-			strhandle();
-		} else {
-			if (!(xw.state & WIN_FOCUSED)) {
-				xseturgency(1);
-			}
-			if (bellvolume) {
-				XkbBell(xw.dpy, xw.win, bellvolume, (Atom)NULL);
-			}
-		}
-		break;
-	case 0x1B:  // ESC
-		csireset();
-		term.esc &= ~(ESC_CSI | ESC_ALTCHARSET | ESC_TEST);
-		term.esc |= ESC_START;
+		tnewline(IS_SET(MODE_CRLF));
+		return;
+	case '\a':  // BEL
+		xbell();
 		return;
 	case 0x0E:  // SO (LS1 -- Locking shift 1)
 	case 0x0F:  // SI (LS0 -- Locking shift 0)
 		term.charset = 1 - (ascii - 0x0E);
+		tspecialize();
 		return;
 	case 0x1A:  // SUB
 		tsetchar('?', &term.c.attr, term.c.x, term.c.y);
+		return;
 	case 0x18:  // CAN
-		csireset();
-		break;
+		return;
 	case 0x05:  // ENQ (IGNORED)
 	case 0x00:  // NUL (IGNORED)
 	case 0x11:  // XON (IGNORED)
@@ -3357,61 +5982,45 @@ tcontrolcode(uchar ascii)
 	case 0x95:  // TODO(townba): MW
 	case 0x96:  // TODO(townba): SPA
 	case 0x97:  // TODO(townba): EPA
-	case 0x98:  // TODO(townba): SOS
 	case 0x99:  // TODO(townba): SGCI
 	case 0x9A:  // DECID -- Identify Terminal
-	case 0x9B:  // TODO(townba): CSI
-	case 0x9C:  // TODO(townba): ST
 		break;
-	case 0x90:  // DCS -- Device Control String
-	case 0x9D:  // OSC -- Operating System Command
-	case 0x9E:  // PM -- Privacy Message
-	case 0x9F:  // APC -- Application Program Command
-		tstrsequence(ascii);
-		return;
 	}
-	// only CAN, SUB, \a and C1 chars interrupt a sequence
-	term.esc &= ~(ESC_STR_END | ESC_STR);
+	// DCS, SOS, CSI, ST, OSC, PM and APC are handled by the parser.
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int
+void
 eschandle(uchar ascii)
 {
-	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
+	switch (csiescseq.interm) {
+	case 0:
+		break;
 	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
+		tdectest(ascii);
+		return;
 	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P':  // DCS -- Device Control String
-	case '_':  // APC -- Application Program Command
-	case '^':  // PM -- Privacy Message
-	case ']':  // OSC -- Operating System Command
-	case 'k':  // old title set compatibility
-		tstrsequence(ascii);
-		return 0;
-	case 'n':  // LS2 -- Locking shift 2
-	case 'o':  // LS3 -- Locking shift 3
-		term.charset = 2 + (ascii - 'n');
-		break;
+		tdefutf8(ascii);
+		return;
 	case '(':  // GZD4 -- set primary charset G0
 	case ')':  // G1D4 -- set secondary charset G1
 	case '*':  // G2D4 -- set tertiary charset G2
 	case '+':  // G3D4 -- set quaternary charset G3
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
+		term.icharset = csiescseq.interm - '(';
+		tdeftran(ascii);
+		return;
+	default:
+		goto unknown;
+	}
+
+	switch (ascii) {
+	case 'n':  // LS2 -- Locking shift 2
+	case 'o':  // LS3 -- Locking shift 3
+		term.charset = 2 + (ascii - 'n');
+		tspecialize();
+		break;
 	case 'D':  // IND -- Linefeed
 		if (term.c.y == term.bot) {
-			tscrollup(term.top, 1);
+			tscrollup(term.top, 1, 1);
 		} else {
 			tmoveto(term.c.x, term.c.y + 1);
 		}
@@ -3449,167 +6058,619 @@ eschandle(uchar ascii)
 		tcursor(CURSOR_LOAD);
 		break;
 	case '\\':  // ST -- String Terminator
-		if (term.esc & ESC_STR_END) {
-			strhandle();
-		}
+		// The string was already handled when ESC arrived.
 		break;
 	default:
+	unknown:
 		fprintf(stderr, "erresc: unknown sequence ESC ");
+		if (csiescseq.interm > 0) {
+			chardump(csiescseq.interm);
+		}
 		chardump(ascii);
 		putc('\n', stderr);
 		break;
 	}
-	return 1;
 }
 
+// Copies a character to the printer and then handles it.
 void
-tputc(Rune u)
+tputcprint(Rune u)
 {
 	char c[max_utf8_bytes];
-	int control;
-	int width = 0;
-	size_t len;
-	Glyph *gp;
 
-	control = ISCONTROL(u);
-	if (IS_SET(MODE_UTF8)) {
-		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1) {
-			len = utf8encode(replacement_rune, c);
-			width = wcwidth(u);
-			if (width == -1) {
-				width = 1;
-			}
-		}
+	tprinter(c, tencode(u, c));
+	tputcparse(u);
+}
+
+void
+tputcparse(Rune u)
+{
+	const Transition *t;
+
+	t = &parsetable[term.esc][MIN(u, PARSE_OTHER)];
+	if (t->state != PS_STAY) {
+		// Change state first, the action may lead to more input.
+		term.esc = t->state;
+		tparseraction(t->action, u);
+		tparseraction(parseentry[t->state], u);
 	} else {
-		c[0] = u;
-		width = len = 1;
+		tparseraction(t->action, u);
 	}
+}
 
-	if (IS_SET(MODE_PRINT)) {
-		tprinter(c, len);
-	}
+void
+tparseraction(int action, Rune u)
+{
+	char c[max_utf8_bytes];
+	size_t len;
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 0x18 || u == 0x1A || u == 0x1B ||
-		    ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START | ESC_STR | ESC_DCS);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
+	switch (action) {
+	case PA_NONE:
+		break;
+	case PA_PRINT:
+		tputglyph(u);
+		break;
+	case PA_EXECUTE:
+		tcontrolcode(u);
+		break;
+	case PA_CLEAR:
+		csireset();
+		break;
+	case PA_COLLECT:
+		if (BETWEEN(u, 0x3C, 0x3F)) {
+			csiescseq.priv = u;
+		} else {
+			csiescseq.interm = csiescseq.interm ? -1 : (int)u;
 		}
-
-		if (strescseq.len + len >= sizeof(strescseq.buf) - 1) {
+		break;
+	case PA_PARAM:
+		if (csiescseq.narg == 0) {
+			csiescseq.narg = 1;
+		}
+		if (u == ';' || u == ':') {
+			if (csiescseq.narg < ESC_ARG_SIZ) {
+				csiescseq.arg[csiescseq.narg] = 0;
+				csiescseq.sub[csiescseq.narg] = u == ':';
+				csiescseq.nsub += u == ':';
+			}
+			if (csiescseq.narg <= ESC_ARG_SIZ) {
+				++csiescseq.narg;
+			}
+		} else if (csiescseq.narg <= ESC_ARG_SIZ) {
+			int *arg = &csiescseq.arg[csiescseq.narg - 1];
+			*arg = MIN(*arg * 10 + (int)(u - '0'), ESC_ARG_MAX);
+		}
+		break;
+	case PA_ESC_DISPATCH:
+		++ttystats.sequences;
+		eschandle(u);
+		break;
+	case PA_CSI_DISPATCH:
+		// Extra parameters are ignored.
+		LIMIT(csiescseq.narg, 1, ESC_ARG_SIZ);
+		csiescseq.final = u;
+		++ttystats.sequences;
+		csihandle();
+		break;
+	case PA_STR_START:
+		tstrsequence(u);
+		break;
+	case PA_STR_PUT:
+		len = tencode(u, c);
+		if (strescseq.len + len >= sizeof(strescseq.buf) - 1 &&
+		    (!strflush() ||
+		     strescseq.len + len >= sizeof(strescseq.buf) - 1)) {
 			/*
 			 * Here is a bug in terminals. If the user never sends
 			 * some code to stop the str or esc command, then st
 			 * will stop responding. But this is better than
 			 * silently failing with unknown characters. At least
 			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
 			 */
-			return;
+			break;
 		}
-
 		memmove(&strescseq.buf[strescseq.len], c, len);
 		strescseq.len += len;
-		return;
+		break;
+	case PA_STR_DISPATCH:
+		++ttystats.sequences;
+		strhandle();
+		break;
 	}
+}
 
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-	if (control) {
-		tcontrolcode(u);
-		// control codes are not shown ever
-		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E) ||
-			    csiescseq.len >= sizeof(csiescseq.buf) - 1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
+// Encodes a character for the printer and for control strings.
+size_t
+tencode(Rune u, char *c)
+{
+	if (!IS_SET(MODE_UTF8)) {
+		c[0] = u;
+		return 1;
+	}
+	if (!ISCONTROL(u) && runewidth(u) == -1) {
+		u = replacement_rune;
+	}
+	return utf8encode(u, c);
+}
+
+/*
+ * Picks tputc(), tputglyph() and the charset translation for the current
+ * modes and charsets, so that handling a character doesn't have to check
+ * them. Called whenever one of them changes.
+ */
+void
+tspecialize(void)
+{
+	trantbl = NULL;
+	for (size_t i = 0; i < LEN(charset_to_table); ++i) {
+		if (term.trantbl[term.charset] == charset_to_table[i].charset) {
+			trantbl = charset_to_table[i].table;
+		}
+	}
+	tputc = IS_SET(MODE_PRINT) ? tputcprint : tputcparse;
+	tputglyph = IS_SET(MODE_UTF8) && IS_SET(MODE_WRAP) &&
+	                    !IS_SET(MODE_INSERT)
+	                ? tputglyphplain
+	                : tputglyphany;
+	tputasciiok = IS_SET(MODE_WRAP) && !IS_SET(MODE_INSERT) &&
+	              !IS_SET(MODE_PRINT) && !trantbl;
+}
+
+// tputglyph() for UTF-8 with auto wrap and without insertion.
+void
+tputglyphplain(Rune u)
+{
+	tputglyphmode(u, 1, 1, 0);
+}
+
+void
+tputglyphany(Rune u)
+{
+	tputglyphmode(u, IS_SET(MODE_UTF8), IS_SET(MODE_WRAP),
+	              IS_SET(MODE_INSERT));
+}
+
+// Writes a character at the cursor; the modes are constant in the callers.
+void
+tputglyphmode(Rune u, int utf8, int wrap, int insert)
+{
+	int width = 1;
+	Attr attr = term.c.attr;
+	Glyph *gp;
+
+	if (utf8 && (width = runewidth(u)) == -1) {
+		width = 1;
+	}
+
+	if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y)) {
+		selclear(NULL);
+	}
+
+	gp = &term.line[term.c.y][term.c.x];
+	if (wrap && (term.c.state & CURSOR_WRAPNEXT)) {
+		gp->attr = tattrmod(gp->attr, ATTR_WRAP, 0);
+		*tlinemode(term.c.y) |= ATTR_WRAP;
+		tnewline(1);
+		gp = &term.line[term.c.y][term.c.x];
+	}
+
+	if (insert && term.c.x + width < term.col) {
+		memmove(gp + width, gp,
+		        (term.col - term.c.x - width) * sizeof(Glyph));
+		tdamage(term.c.y, term.c.x + width, term.col);
+	}
+
+	if (term.c.x + width > term.col) {
+		tnewline(1);
+		gp = &term.line[term.c.y][term.c.x];
+	}
+
+	if (width == 2) {
+		attr.mode |= ATTR_WIDE;
+	}
+	tsetchar(u, &attr, term.c.x, term.c.y);
+
+	if (width == 2 && term.c.x + 1 < term.col) {
+		gp[1].u = 0;
+		gp[1].attr = tattrmod(gp[1].attr, ATTR_WDUMMY, ATTRMODE(gp[1]));
+		tdamage(term.c.y, term.c.x + 1, term.c.x + 2);
+		*tlinemode(term.c.y) |= ATTR_WDUMMY;
+	}
+	if (term.c.x + width < term.col) {
+		tmoveto(term.c.x + width, term.c.y);
+	} else {
+		term.c.state |= CURSOR_WRAPNEXT;
+	}
+}
+
+/*
+ * Fast path for the common case of plain text: writes a run of printable
+ * ASCII characters straight into the screen, one line segment at a time,
+ * instead of going through all the checks in tputc() for every character.
+ * Returns the number of runes consumed, which is 0 when the run is empty or
+ * the terminal is in a state the fast path doesn't handle.
+ */
+size_t
+tputascii(const Rune *u, size_t len)
+{
+	size_t i, n;
+	int j, x, y, x0, x1, run;
+	uint32_t attr;
+	Glyph *gp;
+
+	if (term.esc != PS_GROUND || !tputasciiok) {
+		return 0;
+	}
+	for (n = 0; n < len && BETWEEN(u[n], ' ', '~'); ++n) {
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i += run) {
+		if (term.c.state & CURSOR_WRAPNEXT) {
+			gp = &term.line[term.c.y][term.c.x];
+			gp->attr = tattrmod(gp->attr, ATTR_WRAP, 0);
+			*tlinemode(term.c.y) |= ATTR_WRAP;
+			tnewline(1);
+		}
+		x = term.c.x;
+		y = term.c.y;
+		run = MIN(n - i, (size_t)(term.col - x));
+		if (sel.ob.x != -1 && BETWEEN(y, sel.ob.y, sel.oe.y)) {
+			selclear(NULL);
+		}
+
+		// Only wide characters cut at the edges of the run need fixing.
+		gp = &term.line[y][x];
+		x0 = x;
+		x1 = x + run;
+		// gp[0] itself is overwritten below, dummy or not.
+		if ((ATTRMODE(gp[0]) & ATTR_WDUMMY) && x > 0) {
+			gp[-1].u = ' ';
+			gp[-1].attr = tattrmod(gp[-1].attr, 0, ATTR_WIDE);
+			x0--;
 		}
-		if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
+		if ((ATTRMODE(gp[run - 1]) & ATTR_WIDE) && x + run < term.col) {
+			gp[run].u = ' ';
+			gp[run].attr = tattrmod(gp[run].attr, 0, ATTR_WDUMMY);
+			x1++;
+		}
+		attr = tattrid(&term.c.attr);
+		for (j = 0; j < run; ++j) {
+			gp[j] = (Glyph){u[i + j], attr};
+		}
+		tdamage(y, x0, x1);
+		*tlinemode(y) |= term.c.attr.mode;
+
+		if (x + run < term.col) {
+			term.c.x = x + run;
 		} else {
-			if (!eschandle(u)) {
-				return;
+			term.c.x = term.col - 1;
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Returns line l kept through a resize to arena: l itself if arena is the
+ * one it is in, or else a copy of its first len glyphs in the next line of
+ * the new arena. Marks the line in used.
+ */
+Line
+tkeepline(Line l, Glyph *arena, int stride, uchar *used, int *next, int len)
+{
+	if (arena != term.arena) {
+		memcpy(&arena[*next * stride], l, len * sizeof(Glyph));
+		l = &arena[(*next)++ * stride];
+	}
+	used[(l - arena) / stride] = 1;
+
+	return l;
+}
+
+/*
+ * Marks line l of col glyphs as going on in the next one, on its last glyph
+ * or, as tputglyphmode() does, on the wide one the last is the dummy of.
+ */
+void
+tsetwrap(Line l, int col)
+{
+	int x = col - 1 - (col > 1 && ATTRMODE(l[col - 1]) & ATTR_WDUMMY);
+
+	l[x].attr = tattrmod(l[x].attr, ATTR_WRAP, 0);
+}
+
+/*
+ * Returns the next line of a reflow: l if given, or else a free row of the
+ * arena or that of the oldest line kept, which goes to the history when the
+ * ring is full.
+ */
+Line
+treflowrow(Reflow *rf, Line l)
+{
+	Line old = NULL;
+
+	if (rf->n - rf->h == rf->ringsize || (!l && rf->npool == 0)) {
+		old = rf->ring[rf->h++ % rf->ringsize];
+		hpush(old, rf->col);
+	}
+	if (l) {
+		if (old) {
+			rf->pool[rf->npool++] = (old - rf->arena) / rf->stride;
+		}
+		// it may yet wrap, to a cursor past its end
+		term.linemode[(l - rf->arena) / rf->stride] |= ATTR_WRAP;
+	} else {
+		l = old ? old : &rf->arena[rf->pool[--rf->npool] * rf->stride];
+		// the glyphs are copied in, so they may have any mode
+		term.linemode[(l - rf->arena) / rf->stride] = USHRT_MAX;
+	}
+	rf->ring[rf->n++ % rf->ringsize] = l;
+
+	return l;
+}
+
+/*
+ * Rewraps the main screen and the history in the ring to the width of rf.
+ * The lines that wrap make up logical lines, which one pass copies out one
+ * at a time, freeing their rows, and splits again into new lines. Those the
+ * ring has no room for go to the history, and those more than a screen
+ * below the cursor are dropped. The cursors and the selection of the main
+ * screen move along with their glyphs, and the cursor stays on the line of
+ * the screen it was on if it can. Returns the lines of history above the
+ * screen.
+ */
+int
+treflow(Reflow *rf, int row)
+{
+	Line *mainline = &term.ring[term.ringsize + term.start];
+	Glyph *buf = NULL, blank = {' ', ATTRID_BLANK};
+	Mark mk[4];
+	TCursor *cur;
+	Line l, keep;
+	int i, j, m, w, x, y, cy, ylast, last, wrap, len, size = 0;
+	int col = rf->col, nmk = 0, top = -1;
+	int selmoved = sel.ob.x != -1 && !sel.alt;
+
+	// a selection is snapped anew, which needs its screen shown
+	if (selmoved && IS_SET(MODE_ALTSCREEN)) {
+		selclear(NULL);
+		selmoved = 0;
+	}
+
+	// the cursor of the main screen comes first, as it may add lines
+	cur = IS_SET(MODE_ALTSCREEN) ? &term.saved[0] : &term.c;
+	LIMIT(cur->x, 0, term.col - 1);
+	cy = LIMIT(cur->y, 0, term.row - 1);
+	mk[nmk++] = (Mark){&cur->x, &cur->y, -1, 0};
+	if (cur == &term.c) {
+		mk[nmk++] = (Mark){&term.saved[0].x, &term.saved[0].y, -1, 0};
+	}
+	if (selmoved) {
+		mk[nmk++] = (Mark){&sel.ob.x, &sel.ob.y, -1, 0};
+		mk[nmk++] = (Mark){&sel.oe.x, &sel.oe.y, -1, 0};
+	}
+	// new lines are numbered from the oldest in the ring, older ones stay
+	for (j = 0; j < nmk; j++) {
+		if (*mk[j].y < -term.histn) {
+			*mk[j].y += term.histn;
+			mk[j].moved = 1;
+		}
+	}
+
+	// the text ends on the line of the cursor or the last one not blank
+	for (ylast = term.row - 1; ylast > cy; ylast--) {
+		l = mainline[ylast];
+		for (x = 0; x < term.col && l[x].u == ' ' &&
+		            l[x].attr == ATTRID_BLANK;
+		     x++) {
+		}
+		if (x < term.col) {
+			break;
+		}
+	}
+
+	for (y = -term.histn; y <= ylast && (top < 0 || rf->n < top + row);) {
+		/*
+		 * copy a logical line out, which frees its rows, but for one
+		 * that fits in a line of both widths: that one stays put
+		 */
+		len = 0;
+		keep = NULL;
+		do {
+			l = mainline[y];
+			m = term.col;
+			// see tsetwrap()
+			x = m - 1 - (m > 1 && ATTRMODE(l[m - 1]) & ATTR_WDUMMY);
+			wrap = ATTRMODE(l[x]) & ATTR_WRAP;
+			if (wrap) {
+				l[x].attr = tattrmod(l[x].attr, 0, ATTR_WRAP);
+			}
+			wrap = wrap && y < ylast;
+			/*
+			 * A blank before a wide glyph that wraps is taken
+			 * for the one a reflow leaves, trailing ones end the
+			 * line.
+			 */
+			if (wrap && l[m - 1].u == ' ' &&
+			    l[m - 1].attr == ATTRID_BLANK &&
+			    ATTRMODE(mainline[y + 1][0]) & ATTR_WIDE) {
+				m--;
+			}
+			while (!wrap && m > 0 && l[m - 1].u == ' ' &&
+			       l[m - 1].attr == ATTRID_BLANK) {
+				m--;
+			}
+			for (j = 0; j < nmk; j++) {
+				if (!mk[j].moved && *mk[j].y == y) {
+					mk[j].off = len + *mk[j].x;
+				}
+			}
+
+			if (len == 0 && !wrap && m <= col && term.col > 1 &&
+			    rf->arena == term.arena) {
+				keep = l;
+			} else {
+				if (len + m + 1 > size) {
+					size = MAX(2 * size, len + m + 1);
+					buf = (Glyph *)xrealloc(
+					    buf, size * sizeof(Glyph));
+				}
+				memcpy(&buf[len], l, m * sizeof(Glyph));
+				// wide glyphs on lines of one column have no
+				// dummy
+				if (term.col == 1 &&
+				    ATTRMODE(l[0]) & ATTR_WIDE) {
+					buf[len + m++] = (Glyph){
+					    0, tattrmod(l[0].attr, ATTR_WDUMMY,
+					                ATTRMODE(l[0]))};
+				}
+				if (rf->arena == term.arena) {
+					rf->pool[rf->npool++] =
+					    (l - rf->arena) / rf->stride;
+				}
+			}
+			len += m;
+			y++;
+		} while (wrap);
+
+		/*
+		 * and split it again into m glyphs a line out of w: wide
+		 * glyphs go whole to the next line, or without their dummy
+		 * if lines have one column
+		 */
+		for (i = 0;; i += w) {
+			l = treflowrow(rf, keep);
+			m = w = MIN(len - i, col);
+			if (i + m < len && ATTRMODE(buf[i + m]) & ATTR_WDUMMY) {
+				if (col > 1) {
+					w = --m;
+				} else {
+					w = 2;
+				}
+			}
+			if (!keep) {
+				memcpy(l, &buf[i], m * sizeof(Glyph));
+				tfill(&l[m], blank, col - m);
+			} else if (col > term.col) {
+				tfill(&l[term.col], blank, col - term.col);
+			}
+			for (j = 0; j < nmk; j++) {
+				if (BETWEEN(mk[j].off, i, i + w - 1)) {
+					*mk[j].x = MIN(mk[j].off - i, col - 1);
+					*mk[j].y = rf->n - 1;
+					mk[j].off = -1;
+					mk[j].moved = 1;
+				}
+			}
+			if (i + w == len) {
+				break;
+			}
+			tsetwrap(l, col);
+		}
+
+		// points past the text, where the cursor may need more lines
+		last = rf->n - 1;
+		for (j = 0; j < nmk; j++) {
+			if (mk[j].off < len) {
+				continue;
+			}
+			x = m + mk[j].off - len;
+			for (; j == 0 && x >= col; x -= col) {
+				tsetwrap(l, col);
+				l = treflowrow(rf, NULL);
+				tfill(l, blank, col);
 			}
-			// sequence already finished
+			*mk[j].x = MIN(x, col - 1);
+			*mk[j].y = j == 0 ? rf->n - 1 : last;
+			mk[j].off = -1;
+			mk[j].moved = 1;
 		}
-		term.esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
-		return;
-	}
-	if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y)) {
-		selclear(NULL);
-	}
 
-	gp = &term.line[term.c.y][term.c.x];
-	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
-		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+		if (top < 0 && mk[0].moved) {
+			top = MAX(*mk[0].y - MIN(cy, row - 1), rf->h);
+		}
 	}
+	free(buf);
 
-	if (IS_SET(MODE_INSERT) && term.c.x + width < term.col) {
-		memmove(gp + width, gp,
-		        (term.col - term.c.x - width) * sizeof(Glyph));
+	// the old lines left are blank or dropped
+	for (; y < term.row; y++) {
+		if (rf->arena == term.arena) {
+			rf->pool[rf->npool++] = (mainline[y] - rf->arena) /
+			                        rf->stride;
+		}
+	}
+	for (j = 0; j < nmk; j++) {
+		if (!mk[j].moved) {
+			*mk[j].y += rf->n - y;
+		}
 	}
 
-	if (term.c.x + width > term.col) {
-		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+	// the screen is the row lines from top on, blank ones if need be
+	for (; rf->n > top + row; rf->n--) {
+		l = rf->ring[(rf->n - 1) % rf->ringsize];
+		rf->pool[rf->npool++] = (l - rf->arena) / rf->stride;
+	}
+	while (rf->n < (top = MAX(top, rf->h)) + row) {
+		tfill(treflowrow(rf, NULL), blank, col);
 	}
 
-	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+	// the spare lines of the ring take free rows, and the oldest is first
+	for (i = rf->n; i < rf->h + rf->ringsize; i++) {
+		rf->ring[i % rf->ringsize] =
+		    &rf->arena[rf->pool[--rf->npool] * rf->stride];
+	}
+	for (i = 0; i < rf->ringsize; i++) {
+		rf->ring[rf->ringsize + i] =
+		    rf->ring[(rf->h + i) % rf->ringsize];
+	}
+	memcpy(rf->ring, rf->ring + rf->ringsize,
+	       rf->ringsize * sizeof(Line));
 
-	if (width == 2) {
-		gp->mode |= ATTR_WIDE;
-		if (term.c.x + 1 < term.col) {
-			gp[1].u = 0;
-			gp[1].mode = ATTR_WDUMMY;
-		}
+	for (j = 0; j < nmk; j++) {
+		*mk[j].y -= top;
 	}
-	if (term.c.x + width < term.col) {
-		tmoveto(term.c.x + width, term.c.y);
-	} else {
-		term.c.state |= CURSOR_WRAPNEXT;
+	if (cur == &term.c && term.c.state & CURSOR_WRAPNEXT &&
+	    term.c.x < col - 1) {
+		term.c.x++;
+		term.c.state &= ~CURSOR_WRAPNEXT;
 	}
+	if (selmoved && (MIN(sel.ob.y, sel.oe.y) < rf->h - top - hist.n ||
+	                 MAX(sel.ob.y, sel.oe.y) >= row)) {
+		selclear(NULL);
+	}
+
+	return top - rf->h;
 }
 
+/*
+ * The lines of both screens and of the history in the ring are rows of one
+ * arena, rowcap of them for each screen and histsize + HIST_BATCH for the
+ * history, of stride glyphs each. A resize that fits in it moves no glyph,
+ * only the lines that come and go; otherwise the lines kept are copied to an
+ * arena with room for the new size, and twice the rows if they grew. A change
+ * of width rewraps the main screen and its history, see treflow(), and only
+ * cuts or pads the lines of the alternate screen.
+ */
 void
 tresize(int col, int row)
 {
-	int i;
+	int i, y, slide, histn, next, nslots, state;
 	int minrow = MIN(row, term.row);
 	int mincol = MIN(col, term.col);
+	int ringsize = histsize + HIST_BATCH + row;
+	int stride = MAX(col, term.stride);
+	int rowcap = row > term.rowcap ? MAX(row, 2 * term.rowcap)
+	                               : term.rowcap;
+	int reflow = term.ring && col != term.col;
 	int *bp;
+	uchar *used;
+	Glyph *arena = term.arena;
+	Line *ring, *alt, *mainline;
+	Reflow rf;
 	TCursor c;
 
 	if (col < 1 || row < 1 || col > USHRT_MAX || row > USHRT_MAX) {
@@ -3618,46 +6679,119 @@ tresize(int col, int row)
 	}
 
 	/*
-	 * slide screen to keep cursor where we expect it -
-	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
+	 * slide screen to keep cursor where we expect it - the lines slid
+	 * off the main screen go to the history, those of the alternate
+	 * screen are dropped
 	 */
-	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
-	// ensure that both src and dst are not NULL
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
-	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+	slide = MAX(0, term.c.y - row + 1);
+	histn = MIN(term.histn + slide, (int)histsize);
+	if (!reflow && sel.ob.x != -1 && !sel.alt &&
+	    sel.nb.y < slide - histn) {
+		selclear(NULL);
 	}
 
-	// resize to new width
-	term.specbuf = (XftGlyphFontSpec *)xrealloc(
-	    term.specbuf, col * sizeof(XftGlyphFontSpec));
+	// the old lines of the main screen and history, by screen line
+	mainline = term.ring ? &term.ring[term.ringsize + term.start] : NULL;
+	for (y = -term.histn; !reflow && y < slide - histn; y++) {
+		hpush(mainline[y], term.col);
+	}
 
-	// resize to new height
-	term.line = (Line *)xrealloc(term.line, row * sizeof(Line));
-	term.alt = (Line *)xrealloc(term.alt, row * sizeof(Line));
-	term.dirty = (int *)xrealloc(term.dirty, row * sizeof(*term.dirty));
-	term.tabs = (int *)xrealloc(term.tabs, col * sizeof(*term.tabs));
+	nslots = histsize + HIST_BATCH + 2 * rowcap;
+	if (stride != term.stride || rowcap != term.rowcap) {
+		arena = (Glyph *)xmalloc((size_t)nslots * stride *
+		                         sizeof(Glyph));
+		// the lines move, so they may have any mode for a start
+		term.linemode = (ushort *)xrealloc(
+		    term.linemode, nslots * sizeof(*term.linemode));
+		memset(term.linemode, 0xFF, nslots * sizeof(*term.linemode));
+	}
+	used = (uchar *)xmalloc(nslots);
+	memset(used, 0, nslots);
+	next = 0;
 
-	// resize each row to new width, zero-pad if needed
+	// rebuild the ring with the history first, resized to the new width
+	ring = (Line *)xmalloc(3 * ringsize * sizeof(Line));
+	for (y = slide - histn, i = 0; !reflow && y < slide + minrow;
+	     y++, i++) {
+		ring[i] = tkeepline(mainline[y], arena, stride, used, &next,
+		                    mincol);
+		if (y < slide && term.col < col) {
+			tfill(&ring[i][term.col], (Glyph){' ', ATTRID_BLANK},
+			      col - term.col);
+		}
+	}
+	alt = (Line *)xmalloc(row * sizeof(Line));
 	for (i = 0; i < minrow; i++) {
-		term.line[i] =
-		    (Line)xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i] = (Line)xrealloc(term.alt[i], col * sizeof(Glyph));
+		alt[i] = tkeepline(term.alt[slide + i], arena, stride, used,
+		                   &next, mincol);
+	}
+
+	// the lines to rewrap keep their rows until they are read
+	for (y = -term.histn; reflow && arena == term.arena && y < term.row;
+	     y++) {
+		used[(mainline[y] - arena) / stride] = 1;
 	}
 
-	// allocate any new rows
-	for (/* i == minrow */; i < row; i++) {
-		term.line[i] = (Line)xmalloc(col * sizeof(Glyph));
-		term.alt[i] = (Line)xmalloc(col * sizeof(Glyph));
+	// the new lines take the rows of the arena left
+	rf = (Reflow){ring, ringsize, col, 0, 0, arena, stride,
+	              (int *)xmalloc(nslots * sizeof(int)), 0};
+	for (i = nslots; i-- > 0;) {
+		if (!used[i]) {
+			rf.pool[rf.npool++] = i;
+		}
+	}
+	free(used);
+	if (reflow) {
+		histn = treflow(&rf, row);
 	}
+	for (i = reflow ? ringsize : histn + minrow;
+	     i < ringsize + row - minrow; i++) {
+		if (i < ringsize) {
+			ring[i] = &arena[rf.pool[--rf.npool] * stride];
+		} else {
+			alt[i - ringsize + minrow] =
+			    &arena[rf.pool[--rf.npool] * stride];
+		}
+	}
+	free(rf.pool);
+
+	memcpy(ring + ringsize, ring, ringsize * sizeof(Line));
+	memcpy(ring + 2 * ringsize, ring, ringsize * sizeof(Line));
+	free(term.ring);
+	free(term.alt);
+	if (arena != term.arena) {
+		free(term.arena);
+	}
+	term.ring = ring;
+	term.ringsize = ringsize;
+	term.start = histn;
+	term.histn = histn;
+	term.alt = alt;
+	term.arena = arena;
+
+	// the rows and columns of the other buffers only ever grow
+	if (rowcap != term.rowcap) {
+		term.dirty = (int *)xrealloc(term.dirty,
+		                             rowcap * sizeof(*term.dirty));
+		term.damage = (Damage *)xrealloc(
+		    term.damage, rowcap * sizeof(*term.damage));
+		term.gen = (ulong *)xrealloc(term.gen,
+		                             rowcap * sizeof(*term.gen));
+		for (i = term.rowcap; i < rowcap; i++) {
+			term.dirty[i] = 0;
+			term.gen[i] = 0;
+		}
+	}
+	if (stride != term.stride) {
+		term.tabs = (int *)xrealloc(term.tabs,
+		                            stride * sizeof(*term.tabs));
+	}
+	term.rowcap = rowcap;
+	term.stride = stride;
+
+	term.line = IS_SET(MODE_ALTSCREEN) ? term.alt
+	                                   : &term.ring[ringsize + term.start];
+	term.scroll = 0;
 	if (col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -3674,15 +6808,27 @@ tresize(int col, int row)
 	// reset scrolling region
 	tsetscroll(0, row - 1);
 	// make use of the LIMIT in tmoveto
+	state = term.c.state;
 	tmoveto(term.c.x, term.c.y);
-	// Clearing both screens (it makes dirty all lines)
+	if (reflow && !IS_SET(MODE_ALTSCREEN)) {
+		term.c.state |= state & CURSOR_WRAPNEXT;
+	}
+	if (reflow && sel.ob.x != -1 && !sel.alt) {
+		selnormalize();
+	}
+	// Clearing both screens (it makes dirty all lines), but for rewrapped
+	// lines, which are whole
 	c = term.c;
 	for (i = 0; i < 2; i++) {
-		if (mincol < col && 0 < minrow) {
-			tclearregion(mincol, 0, col - 1, minrow - 1);
-		}
-		if (0 < col && minrow < row) {
-			tclearregion(0, minrow, col - 1, row - 1);
+		if (reflow && !IS_SET(MODE_ALTSCREEN)) {
+			tfulldirt();
+		} else {
+			if (mincol < col && 0 < minrow) {
+				tclearregion(mincol, 0, col - 1, minrow - 1);
+			}
+			if (0 < col && minrow < row) {
+				tclearregion(0, minrow, col - 1, row - 1);
+			}
 		}
 		tswapscreen();
 		tcursor(CURSOR_LOAD);
@@ -3701,8 +6847,11 @@ xresize(int col, int row)
 	                       DefaultDepth(xw.dpy, xw.scr));
 	XftDrawChange(xw.draw, xw.buf);
 	xclear(0, 0, xw.w, xw.h);
+	// the new pixmap is blank
+	drawn.row = drawn.col = 0;
 }
 
+#ifndef HEADLESS
 ushort
 sixd_to_16bit(int x)
 {
@@ -3740,6 +6889,7 @@ xloadcols(void)
 	static int loaded;
 	Color *cp;
 
+	pthread_mutex_lock(&xlock);
 	if (loaded) {
 		for (cp = dc.col; cp < &dc.col[LEN(dc.col)]; ++cp) {
 			XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
@@ -3757,6 +6907,7 @@ xloadcols(void)
 		}
 	}
 	loaded = 1;
+	pthread_mutex_unlock(&xlock);
 }
 
 int
@@ -3768,23 +6919,27 @@ xsetcolorname(int x, const char *name)
 		return 1;
 	}
 
+	pthread_mutex_lock(&xlock);
 	if (!xloadcolor(x, name, &ncolor)) {
+		pthread_mutex_unlock(&xlock);
 		return 1;
 	}
 
 	XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
 	dc.col[x] = ncolor;
+	pthread_mutex_unlock(&xlock);
 
 	return 0;
 }
+#endif
 
 // Absolute coordinates.
 void
 xclear(int x1, int y1, int x2, int y2)
 {
 	XftDrawRect(xw.draw,
-	            &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg], x1,
-	            y1, x2 - x1, y2 - y1);
+	            &dc.col[frame->mode & MODE_REVERSE ? defaultfg : defaultbg],
+	            x1, y1, x2 - x1, y2 - y1);
 }
 
 void
@@ -4037,6 +7192,7 @@ xzoomreset(UNUSED int unused)
 	}
 }
 
+#ifndef HEADLESS
 const char *
 xgetresstr(XrmDatabase xrmdb, const char *name, const char *xclass,
            const char *def)
@@ -4267,9 +7423,13 @@ xinit(int argc, char *argv[])
 	XSync(xw.dpy, False);
 }
 
+/*
+ * Makes the specs of len glyphs, whose attributes are in attrs. Only the mode
+ * matters here, so FRAME_REVERSE is ignored.
+ */
 int
-xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len,
-                    int x, int y)
+xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs,
+                    const Attr *attrs, int len, int x, int y)
 {
 	float winx = borderpx + x * xw.cw, winy = borderpx + y * xw.ch, xp, yp;
 	ushort mode, prevmode = USHRT_MAX;
@@ -4288,7 +7448,7 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len,
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
 		// Fetch rune and mode for current glyph.
 		rune = glyphs[i].u;
-		mode = glyphs[i].mode;
+		mode = attrs[glyphs[i].attr & ~FRAME_REVERSE].mode;
 
 		// Skip dummy wide-character spacing.
 		if (mode == ATTR_WDUMMY) {
@@ -4415,7 +7575,7 @@ xgetcolor(uint32_t basecol, XRenderColor *rendercol, Color *truecol)
 }
 
 void
-xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x,
+xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Attr base, int len, int x,
                     int y)
 {
 	int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
@@ -4454,7 +7614,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x,
 		*destfg = &dc.col[srcfg + 8];
 	}
 
-	if (IS_SET(MODE_REVERSE)) {
+	if (frame->mode & MODE_REVERSE) {
 		if (fg == &dc.col[defaultfg]) {
 			fg = &dc.col[defaultbg];
 		} else {
@@ -4489,7 +7649,7 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x,
 		*destfg = &revfg;
 	}
 
-	if ((base.mode & ATTR_BLINK) && (term.mode & MODE_BLINK)) {
+	if ((base.mode & ATTR_BLINK) && (frame->mode & MODE_BLINK)) {
 		destfg = destbg;
 	}
 
@@ -4500,16 +7660,16 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x,
 	// Intelligent cleaning up of the borders.
 	if (x == 0) {
 		xclear(0, (y == 0) ? 0 : winy, borderpx,
-		       winy + xw.ch + ((y >= term.row - 1) ? xw.h : 0));
+		       winy + xw.ch + ((y >= frame->row - 1) ? xw.h : 0));
 	}
-	if (x + charlen >= term.col) {
+	if (x + charlen >= frame->col) {
 		xclear(winx + width, (y == 0) ? 0 : winy, xw.w,
-		       ((y >= term.row - 1) ? xw.h : (winy + xw.ch)));
+		       ((y >= frame->row - 1) ? xw.h : (winy + xw.ch)));
 	}
 	if (y == 0) {
 		xclear(winx, 0, winx + width, borderpx);
 	}
-	if (y == term.row - 1) {
+	if (y == frame->row - 1) {
 		xclear(winx, winy + xw.ch, winx + width, xw.h);
 	}
 
@@ -4542,51 +7702,63 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x,
 }
 
 void
-xdrawglyph(Glyph g, int x, int y)
+xdrawglyph(Rune u, Attr a, int x, int y)
 {
 	int numspecs;
 	XftGlyphFontSpec spec;
 
-	numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
-	xdrawglyphfontspecs(&spec, g, numspecs, x, y);
+	numspecs = xmakeglyphfontspecs(&spec, &(Glyph){u, 0}, &a, 1, x, y);
+	xdrawglyphfontspecs(&spec, a, numspecs, x, y);
+}
+#endif
+
+// Returns the attributes of a glyph of the frame, reversed if it is selected.
+Attr
+frameattr(Glyph g)
+{
+	Attr a = frame->attrs[g.attr & ~FRAME_REVERSE];
+
+	if (g.attr & FRAME_REVERSE) {
+		a.mode ^= ATTR_REVERSE;
+	}
+	return a;
 }
 
+#ifndef HEADLESS
 void
 xdrawcursor(void)
 {
 	static int oldx = 0, oldy = 0;
 	int curx;
-	Glyph g = {' ', ATTR_NULL, defaultbg, defaultcs}, og;
-	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+	Attr g = {ATTR_NULL, defaultbg, defaultcs};
+	Rune u;
+	TCursor *c = &frame->c;
+	Line *line = frame->line;
 	Color drawcol;
 
-	LIMIT(oldx, 0, term.col - 1);
-	LIMIT(oldy, 0, term.row - 1);
+	LIMIT(oldx, 0, frame->col - 1);
+	LIMIT(oldy, 0, frame->row - 1);
 
-	curx = term.c.x;
+	curx = c->x;
 
 	// adjust position if in dummy
-	if (term.line[oldy][oldx].mode & ATTR_WDUMMY) {
+	if (frameattr(line[oldy][oldx]).mode & ATTR_WDUMMY) {
 		oldx--;
 	}
-	if (term.line[term.c.y][curx].mode & ATTR_WDUMMY) {
+	if (frameattr(line[c->y][curx]).mode & ATTR_WDUMMY) {
 		curx--;
 	}
 
 	// remove the old cursor
-	og = term.line[oldy][oldx];
-	if (ena_sel && selected(oldx, oldy)) {
-		og.mode ^= ATTR_REVERSE;
-	}
-	xdrawglyph(og, oldx, oldy);
+	xdrawglyph(line[oldy][oldx].u, frameattr(line[oldy][oldx]), oldx, oldy);
 
-	g.u = term.line[term.c.y][term.c.x].u;
+	u = line[c->y][c->x].u;
 
 	// Select the right color for the right mode.
-	if (IS_SET(MODE_REVERSE)) {
+	if (frame->mode & MODE_REVERSE) {
 		g.mode |= ATTR_REVERSE;
 		g.bg = defaultfg;
-		if (ena_sel && selected(term.c.x, term.c.y)) {
+		if (frame->cursel) {
 			drawcol = dc.col[defaultcs];
 			g.fg = defaultrcs;
 		} else {
@@ -4594,7 +7766,7 @@ xdrawcursor(void)
 			g.fg = defaultcs;
 		}
 	} else {
-		if (ena_sel && selected(term.c.x, term.c.y)) {
+		if (frame->cursel) {
 			drawcol = dc.col[defaultrcs];
 			g.fg = defaultfg;
 			g.bg = defaultrcs;
@@ -4603,47 +7775,47 @@ xdrawcursor(void)
 		}
 	}
 
-	if (IS_SET(MODE_HIDE)) {
+	if (frame->mode & MODE_HIDE) {
 		return;
 	}
 
 	// draw the new one
 	if (xw.state & WIN_FOCUSED) {
-		switch (xw.cursor) {
+		switch (frame->cursor) {
 		case 7:  // st extension: snowman
-			utf8decode("\xE2\x98\x83", 3, &g.u);
+			utf8decode("\xE2\x98\x83", 3, &u);
 		case 0:  // Blinking Block
 		case 1:  // Blinking Block (Default)
 		case 2:  // Steady Block
-			g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
-			xdrawglyph(g, term.c.x, term.c.y);
+			g.mode |= frameattr(line[c->y][curx]).mode & ATTR_WIDE;
+			xdrawglyph(u, g, c->x, c->y);
 			break;
 		case 3:  // Blinking Underline
 		case 4:  // Steady Underline
 			XftDrawRect(
 			    xw.draw, &drawcol, borderpx + curx * xw.cw,
-			    borderpx + (term.c.y + 1) * xw.ch - cursorthickness,
+			    borderpx + (c->y + 1) * xw.ch - cursorthickness,
 			    xw.cw, cursorthickness);
 			break;
 		case 5:  // Blinking bar
 		case 6:  // Steady bar
 			XftDrawRect(xw.draw, &drawcol, borderpx + curx * xw.cw,
-			            borderpx + term.c.y * xw.ch,
+			            borderpx + c->y * xw.ch,
 			            cursorthickness, xw.ch);
 			break;
 		}
 	} else {
 		XftDrawRect(xw.draw, &drawcol, borderpx + curx * xw.cw,
-		            borderpx + term.c.y * xw.ch, xw.cw - 1, 1);
+		            borderpx + c->y * xw.ch, xw.cw - 1, 1);
 		XftDrawRect(xw.draw, &drawcol, borderpx + curx * xw.cw,
-		            borderpx + term.c.y * xw.ch, 1, xw.ch - 1);
+		            borderpx + c->y * xw.ch, 1, xw.ch - 1);
 		XftDrawRect(xw.draw, &drawcol,
 		            borderpx + (curx + 1) * xw.cw - 1,
-		            borderpx + term.c.y * xw.ch, 1, xw.ch - 1);
+		            borderpx + c->y * xw.ch, 1, xw.ch - 1);
 		XftDrawRect(xw.draw, &drawcol, borderpx + curx * xw.cw,
-		            borderpx + (term.c.y + 1) * xw.ch - 1, xw.cw, 1);
+		            borderpx + (c->y + 1) * xw.ch - 1, xw.cw, 1);
 	}
-	oldx = curx, oldy = term.c.y;
+	oldx = curx, oldy = c->y;
 }
 
 void
@@ -4651,12 +7823,15 @@ xsettitle(const char *p)
 {
 	XTextProperty prop;
 
+	pthread_mutex_lock(&xlock);
 	Xutf8TextListToTextProperty(xw.dpy, (char **)(&p), 1, XUTF8StringStyle,
 	                            &prop);
 	XSetWMName(xw.dpy, xw.win, &prop);
 	XSetTextProperty(xw.dpy, xw.win, &prop, xw.netwmname);
 	XFree(prop.value);
+	pthread_mutex_unlock(&xlock);
 }
+#endif
 
 void
 xresettitle(void)
@@ -4664,69 +7839,212 @@ xresettitle(void)
 	xsettitle(opt_title ? opt_title : "st");
 }
 
+// Draws the whole window again, as after its colors changed.
 void
 redraw(void)
 {
+	pthread_mutex_lock(&xlock);
+	// forget what the window shows
+	drawn.row = drawn.col = 0;
+	pthread_mutex_unlock(&xlock);
 	tfulldirt();
-	draw();
 }
 
+#ifndef HEADLESS
+// Draws the newest frame published by the tty thread.
 void
 draw(void)
 {
-	drawregion(0, 0, term.col, term.row);
+	pthread_mutex_lock(&xlock);
+	if (__atomic_load_n(&framemid, __ATOMIC_ACQUIRE) & FRAME_NEW) {
+		framefront = __atomic_exchange_n(&framemid, framefront,
+		                                 __ATOMIC_ACQ_REL) &
+		             ~FRAME_NEW;
+		frame = &frames[framefront];
+	}
+	drawregion(0, 0, frame->col, frame->row);
 	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, xw.w, xw.h, 0, 0);
 	XSetForeground(
 	    xw.dpy, dc.gc,
-	    dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].pixel);
+	    dc.col[frame->mode & MODE_REVERSE ? defaultfg : defaultbg].pixel);
+	pthread_mutex_unlock(&xlock);
 }
 
+/*
+ * Widens the columns *x0 to *x1 - 1 of a line of the frame to the runs of
+ * glyphs xdrawline() draws together, so that drawing them looks the same as
+ * drawing the whole line. A run is made of glyphs of the same attributes, and
+ * the dummies of wide glyphs in it.
+ */
 void
-drawregion(int x1, int y1, int x2, int y2)
+xsnapruns(const Glyph *line, int *x0, int *x1)
+{
+	int x, last;
+
+	for (; *x0 > 0 && frameattr(line[*x0]).mode == ATTR_WDUMMY; --*x0) {
+	}
+	for (x = *x0 - 1; x >= 0; x--) {
+		if (frameattr(line[x]).mode == ATTR_WDUMMY) {
+			continue;
+		}
+		if (ATTRCMP(line[x], line[*x0])) {
+			break;
+		}
+		*x0 = x;
+	}
+
+	for (last = *x1 - 1;
+	     last > *x0 && frameattr(line[last]).mode == ATTR_WDUMMY; last--) {
+	}
+	for (; *x1 < frame->col; ++*x1) {
+		if (frameattr(line[*x1]).mode == ATTR_WDUMMY) {
+			continue;
+		}
+		if (ATTRCMP(line[*x1], line[last])) {
+			break;
+		}
+		last = *x1;
+	}
+}
+#endif
+
+/*
+ * Returns how glyph g of the frame looks, which is all its drawing depends
+ * on but for the frame mode: ATTR_WRAP is left out, and ATTR_BLINK is only
+ * kept while blinking glyphs are hidden.
+ */
+Look
+xlook(Glyph g)
+{
+	Look l = {g.u, frameattr(g)};
+
+	l.a.mode &= ~ATTR_WRAP;
+	if (!(frame->mode & MODE_BLINK)) {
+		l.a.mode &= ~ATTR_BLINK;
+	}
+	return l;
+}
+
+#ifndef HEADLESS
+// Draws the columns x1 to x2 - 1 of line y, which must be whole runs.
+void
+xdrawline(const Glyph *line, int x1, int x2, int y)
 {
-	int i, x, y, ox, numspecs;
+	int i, x, ox, numspecs;
 	Glyph base, gnew;
-	XftGlyphFontSpec *specs;
-	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+	XftGlyphFontSpec *specs = drawn.specbuf;
+	Look *looks = &drawn.looks[y * drawn.col];
+
+	numspecs = xmakeglyphfontspecs(specs, &line[x1], frame->attrs,
+	                               x2 - x1, x1, y);
+
+	i = ox = 0;
+	for (x = x1; x < x2 && i < numspecs; x++) {
+		gnew = line[x];
+		if (frameattr(gnew).mode == ATTR_WDUMMY) {
+			continue;
+		}
+		if (i > 0 && ATTRCMP(base, gnew)) {
+			xdrawglyphfontspecs(specs, frameattr(base), i, ox, y);
+			specs += i;
+			numspecs -= i;
+			i = 0;
+		}
+		if (i == 0) {
+			ox = x;
+			base = gnew;
+		}
+		i++;
+	}
+	if (i > 0) {
+		xdrawglyphfontspecs(specs, frameattr(base), i, ox, y);
+	}
+
+	for (x = x1; x < x2; x++) {
+		looks[x] = xlook(line[x]);
+	}
+}
+
+/*
+ * Draws the lines of the frame that changed since they were last drawn. Of a
+ * line drawn at the generation before, only the columns changed are looked
+ * at, and of a line drawn at all, only the runs of glyphs that look
+ * different from what the window shows are drawn.
+ */
+void
+drawregion(int x1, int y1, int x2, int y2)
+{
+	int y, x0, xn, end, shown;
+	const Glyph *line;
+	const Look *looks;
+	Look l;
 
 	if (!(xw.state & WIN_VISIBLE)) {
 		return;
 	}
 
+	if (drawn.row != frame->row || drawn.col != frame->col ||
+	    drawn.mode != (frame->mode & MODE_REVERSE)) {
+		drawn.row = frame->row;
+		drawn.col = frame->col;
+		drawn.mode = frame->mode & MODE_REVERSE;
+		if (drawn.row > drawn.rowcap || drawn.col > drawn.colcap) {
+			drawn.rowcap = MAX(drawn.rowcap, drawn.row);
+			drawn.colcap = MAX(drawn.colcap, drawn.col);
+			drawn.gen = (ulong *)xrealloc(
+			    drawn.gen, drawn.rowcap * sizeof(*drawn.gen));
+			drawn.looks = (Look *)xrealloc(
+			    drawn.looks,
+			    drawn.rowcap * drawn.colcap * sizeof(Look));
+			drawn.specbuf = (XftGlyphFontSpec *)xrealloc(
+			    drawn.specbuf,
+			    drawn.colcap * sizeof(XftGlyphFontSpec));
+		}
+		memset(drawn.gen, 0, drawn.row * sizeof(*drawn.gen));
+	}
+
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y]) {
+		if (drawn.gen[y] == frame->gen[y]) {
 			continue;
 		}
 
-		term.dirty[y] = 0;
-
-		specs = term.specbuf;
-		numspecs = xmakeglyphfontspecs(specs, &term.line[y][x1],
-		                               x2 - x1, x1, y);
-
-		i = ox = 0;
-		for (x = x1; x < x2 && i < numspecs; x++) {
-			gnew = term.line[y][x];
-			if (gnew.mode == ATTR_WDUMMY) {
-				continue;
-			}
-			if (ena_sel && selected(x, y)) {
-				gnew.mode ^= ATTR_REVERSE;
-			}
-			if (i > 0 && ATTRCMP(base, gnew)) {
-				xdrawglyphfontspecs(specs, base, i, ox, y);
-				specs += i;
-				numspecs -= i;
-				i = 0;
-			}
-			if (i == 0) {
-				ox = x;
-				base = gnew;
+		x0 = x1;
+		xn = x2;
+		if (drawn.gen[y] && drawn.gen[y] == frame->damage[y].gen) {
+			x0 = MAX(x0, frame->damage[y].x0);
+			xn = MIN(xn, frame->damage[y].x1);
+		}
+		shown = drawn.gen[y] != 0;
+		drawn.gen[y] = frame->gen[y];
+		line = frame->line[y];
+		looks = &drawn.looks[y * drawn.col];
+
+		while (x0 < xn) {
+			end = xn;
+			if (shown) {
+				for (; x0 < xn; x0++) {
+					l = xlook(line[x0]);
+					if (l.u != looks[x0].u ||
+					    !ATTREQ(l.a, looks[x0].a)) {
+						break;
+					}
+				}
+				for (end = x0; end < xn; end++) {
+					l = xlook(line[end]);
+					if (l.u == looks[end].u &&
+					    ATTREQ(l.a, looks[end].a)) {
+						break;
+					}
+				}
+				if (x0 == end) {
+					break;
+				}
 			}
-			i++;
-		}
-		if (i > 0) {
-			xdrawglyphfontspecs(specs, base, i, ox, y);
+			xsnapruns(line, &x0, &end);
+			x0 = MAX(x0, x1);
+			end = MIN(end, x2);
+			xdrawline(line, x0, end, y);
+			x0 = end;
 		}
 	}
 	xdrawcursor();
@@ -4755,8 +8073,10 @@ unmap(UNUSED XEvent *unused)
 void
 xsetpointermotion(int set)
 {
+	pthread_mutex_lock(&xlock);
 	MODBIT(xw.attrs.event_mask, set, PointerMotionMask);
 	XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+	pthread_mutex_unlock(&xlock);
 }
 
 void
@@ -4769,6 +8089,30 @@ xseturgency(int add)
 	XFree(h);
 }
 
+void
+xbell(void)
+{
+	pthread_mutex_lock(&xlock);
+	if (!(xw.state & WIN_FOCUSED)) {
+		xseturgency(1);
+	}
+	if (bellvolume) {
+		XkbBell(xw.dpy, xw.win, bellvolume, (Atom)NULL);
+	}
+	pthread_mutex_unlock(&xlock);
+}
+
+// Resizes the window to the given number of columns.
+void
+xsetcols(int cols)
+{
+	pthread_mutex_lock(&xlock);
+	cresize(cols * xw.cw + 2 * borderpx, 0);
+	ttyresize();
+	XResizeWindow(xw.dpy, xw.win, xw.w, xw.h);
+	pthread_mutex_unlock(&xlock);
+}
+
 void
 focus(XEvent *ev)
 {
@@ -4793,6 +8137,7 @@ focus(XEvent *ev)
 		}
 	}
 }
+#endif
 
 int
 modifiers_match(uint mask, uint state)
@@ -4800,6 +8145,7 @@ modifiers_match(uint mask, uint state)
 	return mask == XK_ANY_MOD || mask == (state & ~ignoremod);
 }
 
+#ifndef HEADLESS
 const char *
 kmap(KeySym k, uint state)
 {
@@ -4916,6 +8262,7 @@ cmessage(XEvent *e)
 		exit_with_code = 0;
 	}
 }
+#endif
 
 void
 cresize(int width, int height)
@@ -4936,6 +8283,7 @@ cresize(int width, int height)
 	xresize(col, row);
 }
 
+#ifndef HEADLESS
 void
 resize(XEvent *e)
 {
@@ -4954,8 +8302,11 @@ run(void)
 	int w = xw.w, h = xw.h;
 	fd_set rfd;
 	int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
+	int syncing;
 	struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
 	long deltatime;
+	pthread_t tty;
+	char drain[64];
 
 	// Waiting for window mapping
 	do {
@@ -4978,6 +8329,16 @@ run(void)
 	ttynew();
 	ttyresize();
 
+	if (pipe(framefd) < 0) {
+		die("pipe failed: %s\n", strerror(errno));
+	}
+	fcntl(framefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(framefd[1], F_SETFL, O_NONBLOCK);
+	tpublish();
+	if ((errno = pthread_create(&tty, NULL, ttythread, NULL)) != 0) {
+		die("pthread_create failed: %s\n", strerror(errno));
+	}
+
 	clock_gettime(CLOCK_MONOTONIC, &last);
 	lastblink = last;
 
@@ -4986,23 +8347,19 @@ run(void)
 			return exit_with_code;
 		}
 		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &rfd);
+		FD_SET(framefd[0], &rfd);
 		FD_SET(xfd, &rfd);
 
-		if (pselect(MAX(xfd, cmdfd) + 1, &rfd, NULL, NULL, tv, NULL) <
-		    0) {
+		if (pselect(MAX(xfd, framefd[0]) + 1, &rfd, NULL, NULL, tv,
+		            NULL) < 0) {
 			if (errno == EINTR) {
 				continue;
 			}
 			die("select failed: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &rfd)) {
-			ttyread();
-			if (blinktimeout) {
-				blinkset = tattrset(ATTR_BLINK);
-				if (!blinkset) {
-					MODBIT(term.mode, 0, MODE_BLINK);
-				}
+		if (FD_ISSET(framefd[0], &rfd)) {
+			while (read(framefd[0], drain, sizeof(drain)) > 0) {
+				;
 			}
 		}
 
@@ -5017,8 +8374,11 @@ run(void)
 
 		dodraw = 0;
 		if (blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
+			pthread_mutex_lock(&termlock);
 			tsetdirtattr(ATTR_BLINK);
 			term.mode ^= MODE_BLINK;
+			tpublish();
+			pthread_mutex_unlock(&termlock);
 			lastblink = now;
 			dodraw = 1;
 		}
@@ -5029,6 +8389,8 @@ run(void)
 		}
 
 		if (dodraw) {
+			pthread_mutex_lock(&termlock);
+			pthread_mutex_lock(&xlock);
 			while (XPending(xw.dpy)) {
 				XNextEvent(xw.dpy, &ev);
 				if (XFilterEvent(&ev, None)) {
@@ -5038,14 +8400,24 @@ run(void)
 					(handler[ev.type])(&ev);
 				}
 			}
-
-			draw();
+			tpublish();
+			syncing = IS_SET(MODE_SYNC);
+			pthread_mutex_unlock(&xlock);
+			pthread_mutex_unlock(&termlock);
+
+			// the application has not finished its frame yet
+			if (!syncing) {
+				draw();
+			}
 			XFlush(xw.dpy);
+			blinkset = frame->blink;
 
 			if (xev && !FD_ISSET(xfd, &rfd)) {
 				xev--;
 			}
-			if (!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
+			// keep waking up to end timed out synchronized updates
+			if (!syncing && !FD_ISSET(framefd[0], &rfd) &&
+			    !FD_ISSET(xfd, &rfd)) {
 				if (blinkset) {
 					if (TIMEDIFF(now, lastblink) >
 					    blinktimeout) {
@@ -5083,6 +8455,18 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
+	int ret;
+	pthread_mutexattr_t attr;
+
+	// the tty thread calls into Xlib
+	if (!XInitThreads()) {
+		die("XInitThreads failed\n");
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&xlock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
 	signal(SIGSEGV, sigsegv_handler);
 	argv0 = xstrdup(basename(argv[0]));
 
@@ -5090,9 +8474,244 @@ main(int argc, char *argv[])
 	xw.isfixed = False;
 	xw.cursor = cursorshape;
 
+#ifndef NDEBUG
+	utf8selftest();
+	base64selftest();
+#endif
+
 	setlocale(LC_CTYPE, "");
 	XSetLocaleModifiers("");
 	xinit(argc, argv);
 	selinit();
-	return run();
+	ret = run();
+
+	// the tty thread is still running
+	pthread_mutex_lock(&termlock);
+	tprinterflush();
+
+#ifndef NDEBUG
+	if (ttystats.wakeups > 0) {
+		fprintf(stderr,
+		        "tty: %lu bytes in %lu wakeups, %lu bytes per wakeup, "
+		        "%lu at most\n",
+		        ttystats.bytes, ttystats.wakeups,
+		        ttystats.bytes / ttystats.wakeups, ttystats.maxbytes);
+	}
+#endif
+
+	return ret;
+}
+
+#else  // HEADLESS
+
+/*
+ * st-bench is st without X: it feeds files, or its standard input, to the
+ * terminal as if they came from the tty and reports how fast they were
+ * parsed, and the peak memory use so far. Nothing is drawn and replies to the
+ * tty are dropped. With -m, it runs microbenchmarks of the decoders instead.
+ */
+
+void
+xsetsel(char *str, UNUSED Bool clipboard, UNUSED Time t)
+{
+	free(str);
+}
+
+void
+ttywrite(UNUSED const char *s, UNUSED size_t n)
+{
+}
+
+void
+xloadcols(void)
+{
+}
+
+int
+xsetcolorname(UNUSED int x, UNUSED const char *name)
+{
+	return 0;
+}
+
+void
+xsettitle(UNUSED const char *p)
+{
+}
+
+void
+xsetpointermotion(UNUSED int set)
+{
+}
+
+void
+xbell(void)
+{
+}
+
+void
+xsetcols(int cols)
+{
+	tresize(MAX(cols, 1), term.row);
+}
+
+#ifndef NDEBUG
+/*
+ * Checks that writing over the dummy half of a wide character, left alone in
+ * the first column by deleting the character before it, stays within the line
+ * and leaves no dummy behind.
+ */
+void
+tselftest(void)
+{
+	static const char *vectors[] = {
+	    // through tputascii()
+	    "\xE6\xBC\xA2\r\033[PX",
+	    // through tsetchar()
+	    "\033[31m\xE6\xBC\xA2\r\033[P\xE3\x81\x82",
+	};
+	static const char mark[] = "\033[999G#\r\n";
+	size_t i;
+
+	for (i = 0; i < LEN(vectors); ++i) {
+		treset();
+		twrite(mark, sizeof(mark) - 1);
+		twrite(vectors[i], strlen(vectors[i]));
+		assert(term.line[0][term.col - 1].u == '#');
+		assert(!(ATTRMODE(term.line[0][term.col - 1]) & ATTR_WIDE));
+		assert(term.line[1][0].u != 0);
+		assert(!(ATTRMODE(term.line[1][0]) & ATTR_WDUMMY));
+	}
+	treset();
+}
+#endif
+
+// Compares the implementations of base64decode() on 16 MiB of base64.
+void
+benchbase64(void)
+{
+	static const char alphabet[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *names[3] = {"scalar"};
+	size_t (*impls[3])(const char *, size_t, uchar *, size_t *) = {
+	    base64decode_scalar};
+	size_t i, len = 16 << 20, outlen, nimpls = 1;
+	struct timespec start, end;
+	double secs, best;
+	char *enc = xmalloc(len);
+	uchar *out = xmalloc(len / 4 * 3 + 3);
+	int run;
+
+#if defined(X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		names[nimpls] = "ssse3";
+		impls[nimpls++] = base64decode_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		names[nimpls] = "avx2";
+		impls[nimpls++] = base64decode_avx2;
+	}
+#endif
+	srand(1);
+	for (i = 0; i < len; ++i) {
+		enc[i] = alphabet[rand() % 64];
+	}
+
+	for (i = 0; i < nimpls; ++i) {
+		best = 0;
+		for (run = 0; run < 5; ++run) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (impls[i](enc, len, out, &outlen) != len) {
+				die("base64 %s failed\n", names[i]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			secs = (end.tv_sec - start.tv_sec) +
+			       (end.tv_nsec - start.tv_nsec) / 1E9;
+			best = MAX(best, len / MAX(secs, 1E-9) / 1E6);
+		}
+		printf("base64 %s: %.1f MB/s\n", names[i], best);
+	}
+
+	free(enc);
+	free(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	struct rusage usage;
+	ulong bytes, runes, sequences;
+	const char *name;
+	double secs;
+	int i;
+
+	argv0 = xstrdup(basename(argv[0]));
+	--argc, ++argv;
+
+#ifndef NDEBUG
+	utf8selftest();
+	base64selftest();
+#endif
+
+	if (argc > 0 && !strcmp(argv[0], "-m")) {
+		benchbase64();
+		return 0;
+	}
+	if (argc > 0 && !strcmp(argv[0], "-g")) {
+		if (argc < 2 || sscanf(argv[1], "%ux%u", &opt_cols,
+		                       &opt_rows) != 2) {
+			die("usage: %s [-m | [-g <cols>x<rows>] [file...]]\n",
+			    argv0);
+		}
+		argc -= 2, argv += 2;
+	}
+
+	sel.ob.x = -1;
+	tnew(MAX(opt_cols, 1), MAX(opt_rows, 1));
+#ifndef NDEBUG
+	tselftest();
+#endif
+
+	for (i = 0; i < MAX(argc, 1); ++i) {
+		name = argc > 0 ? argv[i] : "-";
+		if (!strcmp(name, "-")) {
+			cmdfd = STDIN_FILENO;
+		} else if ((cmdfd = open(name, O_RDONLY)) < 0) {
+			die("open %s failed: %s\n", name, strerror(errno));
+		}
+
+		bytes = ttystats.bytes;
+		runes = ttystats.runes;
+		sequences = ttystats.sequences;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (ttyread() > 0) {
+		}
+		// as st does once the tty is idle
+		thistidle();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		bytes = ttystats.bytes - bytes;
+		runes = ttystats.runes - runes;
+		sequences = ttystats.sequences - sequences;
+
+		if (cmdfd != STDIN_FILENO) {
+			close(cmdfd);
+		}
+
+		secs = (end.tv_sec - start.tv_sec) +
+		       (end.tv_nsec - start.tv_nsec) / 1E9;
+		secs = MAX(secs, 1E-9);
+		getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+		usage.ru_maxrss /= 1024;  // in bytes rather than KiB
+#endif
+		printf("%s: %lu bytes in %.3f s, %.1f MB/s, %.0f runes/s, "
+		       "%.0f sequences/s, peak RSS %ld KiB\n",
+		       name, bytes, secs, bytes / secs / 1E6, runes / secs,
+		       sequences / secs, usage.ru_maxrss);
+	}
+
+	return 0;
 }
+
+#endif  // HEADLESS